@@ -40,17 +40,157 @@
   resources.
 ----------------------------------------------------------------------------*/
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
 #include <xorg-server.h>
+#include <spice/macros.h>
 #include "qxl.h"
+#include "qxl_surface.h"
 #include "dfps.h"
+#include "murmurhash3.h"
+
+/* Damage on the screen pixmap is accumulated in a bitmap of fixed size
+ * tiles, so marking an operation costs a few word writes instead of a
+ * region append and re-validate. The ticker turns the bitmap into
+ * rectangles once per frame. */
+#define DFPS_TILE_SHIFT     6
+#define DFPS_TILE_SIZE      (1 << DFPS_TILE_SHIFT)
+
+/* A vertical shift is only sent as COPY_BITS when at least this many
+ * consecutive rows moved together. */
+#define DFPS_SCROLL_MIN_ROWS    32
+
+/* The frame rate governor runs at the configured rate while the user is
+ * interacting, and backs off towards deferred_fps_min over the idle
+ * window. */
+#define DFPS_INPUT_ACTIVE_MS    1000
+#define DFPS_INPUT_IDLE_MS      10000
+#define DFPS_RING_BUSY_PERCENT  50
+#define DFPS_MEM_LOW_PERCENT    25
+
+/* Damage that follows a key or button press within the grace window is
+ * sent after DFPS_INPUT_FLUSH_MS instead of waiting for the next frame
+ * slot; the short delay lets the client finish drawing its response. */
+#define DFPS_INPUT_GRACE_MS     100
+#define DFPS_INPUT_FLUSH_MS     4
+
+#define DFPS_ROW_EMPTY          -1
+#define DFPS_ROW_AMBIGUOUS      -2
+
+typedef struct _dfps_tiles_t
+{
+    int         width;
+    int         height;
+    int         tiles_x;
+    int         tiles_y;
+    int         stride;     /* bitmap words per row of tiles */
+    int         n_dirty;
+    uint32_t   *dirty;
+    BoxPtr      boxes;      /* scratch for dfps_tiles_to_boxes */
+    int        *open;
+
+    /* content hash of each tile as last sent to the client */
+    uint64_t   *hashes;     /* two words per tile */
+    uint32_t   *hash_valid; /* same layout as dirty */
+    uint8_t    *scratch;    /* one tile worth of pixels */
+
+    /* copy of the frame as the client has it, for scroll detection */
+    int         cpp;
+    int         sent_stride;
+    uint8_t    *sent;
+    Bool        sent_valid;
+    uint32_t   *cur_rows;   /* per row hashes, current frame */
+    uint32_t   *sent_rows;  /* per row hashes, sent frame */
+    uint32_t   *table_keys; /* sent row hash -> row index */
+    int        *table_rows;
+    int         table_mask;
+    int        *votes;      /* indexed by shift + height */
+} dfps_tiles_t;
+
+/* Frames are processed on a worker thread, in two passes. On a tick the
+ * X thread copies the dirty tiles of the screen into the capture buffer,
+ * hands it over together with the dirty bitmap and goes back to drawing.
+ * The worker detects scrolling, drops unchanged tiles, plans the upload
+ * rectangles and hashes their pixels. The X thread then allocates an
+ * image for each rectangle, and the worker copies the pixels in. Only
+ * the allocations and pushing the commands are left to the X thread: the
+ * allocator and the ring are not thread safe.
+ *
+ * The worker wakes the X thread through an eventfd at the end of each
+ * pass. Servers without SetNotifyFd watch it through the spice core in
+ * Xspice; the driver on such servers polls instead. */
+#if XORG_VERSION_CURRENT >= XORG_VERSION_NUMERIC(1, 19, 0, 0, 0)
+#define DFPS_NOTIFY_FD 1
+#endif
+
+#define DFPS_WORKER_POLL_MS     2
+
+typedef enum
+{
+    DFPS_JOB_IDLE,
+    DFPS_JOB_PLAN,          /* owned by the worker thread */
+    DFPS_JOB_PLANNED,
+    DFPS_JOB_FILL,          /* likewise */
+    DFPS_JOB_DONE,
+} dfps_job_state_t;
+
+typedef struct _dfps_worker_t
+{
+    pthread_t           thread;
+    Bool                has_thread;
+    pthread_mutex_t     lock;
+    pthread_cond_t      cond;
+    dfps_job_state_t    state;
+    Bool                quit;
+    int                 event_fd;   /* written at the end of each pass */
+    Bool                notify;     /* and watched by the X thread */
+#if !defined(DFPS_NOTIFY_FD) && defined(XSPICE)
+    SpiceWatch         *watch;
+#endif
+
+    qxl_screen_t       *qxl;
+    dfps_tiles_t       *tiles;      /* dirty tiles of the job, sent frame */
+    uint8_t            *capture;    /* the screen as of the tick */
+    int                 stride;
+    int                 cpp;
+
+    /* results */
+    Bool                scroll;
+    BoxRec              scroll_box;
+    int                 scroll_dy;
+    int                 n_boxes;    /* before planning, for the debug log */
+    int                 n_plan;
+    CARD32              input_time; /* input answered by this job, or 0 */
+    BoxRec              plan[QXL_UPLOAD_PLAN_MAX];
+    uint32_t            plan_hash[QXL_UPLOAD_PLAN_MAX];
+
+    /* device memory for the first n_images rectangles of the plan */
+    int                 n_images;
+    struct qxl_image_reservation images[QXL_UPLOAD_PLAN_MAX];
+} dfps_worker_t;
 
 typedef struct _dfps_info_t
 {
-    RegionRec   updated_region;
+    dfps_tiles_t *tiles;    /* only for the screen pixmap */
+    dfps_worker_t *worker;  /* likewise */
 
     PixmapPtr   copy_src;
     Pixel       solid_pixel;
     GCPtr       pgc;
+
+    /* set up by dfps_prepare_composite */
+    int             composite_op;
+    pixman_image_t *composite_src;
+    pixman_image_t *composite_mask;
+    pixman_image_t *composite_dst;
 } dfps_info_t;
 
 static inline dfps_info_t *dfps_get_info (PixmapPtr pixmap)
@@ -66,10 +206,521 @@ static inline void dfps_set_info (PixmapPtr pixmap, dfps_info_t *info)
 {
     dixSetPrivate(&pixmap->devPrivates, &uxa_pixmap_index, info);
 }
+
+static void dfps_tiles_free (dfps_tiles_t *tiles)
+{
+    if (!tiles)
+        return;
+    free(tiles->dirty);
+    free(tiles->boxes);
+    free(tiles->open);
+    free(tiles->hashes);
+    free(tiles->hash_valid);
+    free(tiles->scratch);
+    free(tiles->sent);
+    free(tiles->cur_rows);
+    free(tiles->sent_rows);
+    free(tiles->table_keys);
+    free(tiles->table_rows);
+    free(tiles->votes);
+    free(tiles);
+}
+
+static dfps_tiles_t *dfps_tiles_create (int width, int height, int bpp,
+                                        Bool track_sent)
+{
+    dfps_tiles_t *tiles = calloc(1, sizeof(*tiles));
+    int table_size;
+
+    if (!tiles)
+        return NULL;
+
+    tiles->width = width;
+    tiles->height = height;
+    tiles->tiles_x = (width + DFPS_TILE_SIZE - 1) >> DFPS_TILE_SHIFT;
+    tiles->tiles_y = (height + DFPS_TILE_SIZE - 1) >> DFPS_TILE_SHIFT;
+    tiles->stride = (tiles->tiles_x + 31) / 32;
+    tiles->dirty = calloc(tiles->stride * tiles->tiles_y, sizeof(uint32_t));
+    tiles->boxes = malloc(tiles->tiles_x * tiles->tiles_y * sizeof(BoxRec));
+    tiles->open = malloc(tiles->tiles_x * sizeof(int));
+    if (!tiles->dirty || !tiles->boxes || !tiles->open)
+    {
+        dfps_tiles_free(tiles);
+        return NULL;
+    }
+
+    /* Only the worker's map compares against what the client has; the
+     * live and hybrid maps just collect damage. */
+    if (!track_sent)
+        return tiles;
+
+    tiles->hashes = malloc(tiles->tiles_x * tiles->tiles_y * 2 * sizeof(uint64_t));
+    tiles->hash_valid = calloc(tiles->stride * tiles->tiles_y, sizeof(uint32_t));
+    tiles->scratch = malloc(DFPS_TILE_SIZE * DFPS_TILE_SIZE * sizeof(uint32_t));
+    if (!tiles->hashes || !tiles->hash_valid || !tiles->scratch)
+    {
+        dfps_tiles_free(tiles);
+        return NULL;
+    }
+
+    /* Scroll detection is optional; without the memory for it the
+     * tiles are simply uploaded. */
+    for (table_size = 1; table_size < height * 2; table_size <<= 1)
+        ;
+    tiles->cpp = bpp == 24 ? 4 : bpp / 8;
+    tiles->sent_stride = width * tiles->cpp;
+    tiles->sent = malloc(tiles->sent_stride * height);
+    tiles->cur_rows = malloc(height * sizeof(uint32_t));
+    tiles->sent_rows = malloc(height * sizeof(uint32_t));
+    tiles->table_keys = malloc(table_size * sizeof(uint32_t));
+    tiles->table_rows = malloc(table_size * sizeof(int));
+    tiles->table_mask = table_size - 1;
+    tiles->votes = malloc(height * 2 * sizeof(int));
+    if (!tiles->sent || !tiles->cur_rows || !tiles->sent_rows ||
+        !tiles->table_keys || !tiles->table_rows || !tiles->votes)
+    {
+        free(tiles->sent);
+        tiles->sent = NULL;
+    }
+    return tiles;
+}
+
+/* Returns the tile map of @pixmap if it is the screen pixmap, creating
+ * it or recreating it after a resize. A new map starts out all dirty. */
+static dfps_tiles_t *dfps_get_tiles (PixmapPtr pixmap, dfps_info_t *info)
+{
+    int w = pixmap->drawable.width;
+    int h = pixmap->drawable.height;
+    int y;
+
+    if (pixmap != pixmap->drawable.pScreen->devPrivate)
+        return NULL;
+
+    if (info->tiles && info->tiles->width == w && info->tiles->height == h)
+        return info->tiles;
+
+    dfps_tiles_free(info->tiles);
+    info->tiles = dfps_tiles_create(w, h, pixmap->drawable.bitsPerPixel, FALSE);
+    if (!info->tiles)
+        return NULL;
+
+    for (y = 0; y < info->tiles->tiles_y; y++)
+    {
+        uint32_t *row = info->tiles->dirty + y * info->tiles->stride;
+        int x;
+
+        for (x = 0; x < info->tiles->tiles_x; x++)
+            row[x / 32] |= 1U << (x % 32);
+    }
+    info->tiles->n_dirty = info->tiles->tiles_x * info->tiles->tiles_y;
+    return info->tiles;
+}
+
+static void dfps_tiles_mark (dfps_tiles_t *tiles, int x1, int y1, int x2, int y2)
+{
+    int tx1, tx2, ty;
+
+    if (x1 < 0)
+        x1 = 0;
+    if (y1 < 0)
+        y1 = 0;
+    if (x2 > tiles->width)
+        x2 = tiles->width;
+    if (y2 > tiles->height)
+        y2 = tiles->height;
+    if (x1 >= x2 || y1 >= y2)
+        return;
+
+    tx1 = x1 >> DFPS_TILE_SHIFT;
+    tx2 = (x2 - 1) >> DFPS_TILE_SHIFT;
+
+    for (ty = y1 >> DFPS_TILE_SHIFT; ty <= (y2 - 1) >> DFPS_TILE_SHIFT; ty++)
+    {
+        uint32_t *row = tiles->dirty + ty * tiles->stride;
+        int tx = tx1;
+
+        while (tx <= tx2)
+        {
+            int bit = tx % 32;
+            int n = MIN(32 - bit, tx2 - tx + 1);
+            uint32_t mask = (n == 32) ? ~0U : ((1U << n) - 1) << bit;
+            uint32_t *word = &row[tx / 32];
+
+            tiles->n_dirty += __builtin_popcount(mask & ~*word);
+            *word |= mask;
+            tx += n;
+        }
+    }
+}
+
+static void dfps_schedule (qxl_screen_t *qxl, dfps_tiles_t *tiles);
+
+static void dfps_mark (PixmapPtr pixmap, dfps_info_t *info,
+                       int x1, int y1, int x2, int y2)
+{
+    dfps_tiles_t *tiles = dfps_get_tiles(pixmap, info);
+
+    if (tiles)
+    {
+        ScrnInfoPtr scrn = xf86ScreenToScrn(pixmap->drawable.pScreen);
+
+        dfps_tiles_mark(tiles, x1, y1, x2, y2);
+        dfps_schedule(scrn->driverPrivate, tiles);
+    }
+}
+
+static inline Bool dfps_tile_is_dirty (dfps_tiles_t *tiles, int tx, int ty)
+{
+    return !!(tiles->dirty[ty * tiles->stride + tx / 32] & (1U << (tx % 32)));
+}
+
+static uint8_t *dfps_pixmap_bits (PixmapPtr pixmap, int *stride_bytes, int *cpp)
+{
+    FbBits *data;
+    int stride, bpp;
+
+    fbGetPixmapBitsData(pixmap, data, stride, bpp);
+    *stride_bytes = stride * sizeof(FbBits);
+    *cpp = bpp == 24 ? 4 : bpp / 8;
+    return (uint8_t *)data;
+}
+
+static void dfps_tile_hash (dfps_tiles_t *tiles, const uint8_t *bits,
+                            int stride, int cpp, int tx, int ty,
+                            uint64_t hash[2])
+{
+    int x1 = tx << DFPS_TILE_SHIFT;
+    int y1 = ty << DFPS_TILE_SHIFT;
+    int x2 = MIN(x1 + DFPS_TILE_SIZE, tiles->width);
+    int y2 = MIN(y1 + DFPS_TILE_SIZE, tiles->height);
+    int row_bytes = (x2 - x1) * cpp;
+    const uint8_t *src = bits + y1 * stride + x1 * cpp;
+    uint8_t *dst = tiles->scratch;
+    int y;
+
+    /* gather the tile so it is hashed in one go */
+    for (y = y1; y < y2; y++)
+    {
+        memcpy(dst, src, row_bytes);
+        dst += row_bytes;
+        src += stride;
+    }
+    MurmurHash3_x64_128(tiles->scratch, dst - tiles->scratch, 0, hash);
+}
+
+/* Clear the dirty bit of every tile whose content is identical to what
+ * was sent last time, and remember the hash of those that changed. */
+static void dfps_tiles_drop_unchanged (dfps_tiles_t *tiles, const uint8_t *bits,
+                                       int stride, int cpp)
+{
+    int tx, ty;
+
+    for (ty = 0; ty < tiles->tiles_y; ty++)
+    {
+        uint32_t *dirty = tiles->dirty + ty * tiles->stride;
+        uint32_t *valid = tiles->hash_valid + ty * tiles->stride;
+
+        for (tx = 0; tx < tiles->tiles_x; tx++)
+        {
+            uint32_t bit = 1U << (tx % 32);
+            uint64_t *old = tiles->hashes + (ty * tiles->tiles_x + tx) * 2;
+            uint64_t hash[2];
+
+            if (!dirty[tx / 32])
+            {
+                tx |= 31;
+                continue;
+            }
+            if (!(dirty[tx / 32] & bit))
+                continue;
+
+            dfps_tile_hash(tiles, bits, stride, cpp, tx, ty, hash);
+            if ((valid[tx / 32] & bit) && old[0] == hash[0] && old[1] == hash[1])
+            {
+                dirty[tx / 32] &= ~bit;
+                tiles->n_dirty--;
+                continue;
+            }
+            old[0] = hash[0];
+            old[1] = hash[1];
+            valid[tx / 32] |= bit;
+        }
+    }
+}
+
+static int dfps_row_lookup (dfps_tiles_t *tiles, uint32_t key)
+{
+    int i = key & tiles->table_mask;
+
+    while (tiles->table_rows[i] != DFPS_ROW_EMPTY)
+    {
+        if (tiles->table_keys[i] == key)
+            return tiles->table_rows[i];
+        i = (i + 1) & tiles->table_mask;
+    }
+    return DFPS_ROW_EMPTY;
+}
+
+static void dfps_row_insert (dfps_tiles_t *tiles, uint32_t key, int row)
+{
+    int i = key & tiles->table_mask;
+
+    while (tiles->table_rows[i] != DFPS_ROW_EMPTY)
+    {
+        if (tiles->table_keys[i] == key)
+        {
+            /* repeated rows (blank lines etc.) say nothing about motion */
+            tiles->table_rows[i] = DFPS_ROW_AMBIGUOUS;
+            return;
+        }
+        i = (i + 1) & tiles->table_mask;
+    }
+    tiles->table_keys[i] = key;
+    tiles->table_rows[i] = row;
+}
+
+/* Pixel extents of the dirty tiles; FALSE when there are none. */
+static Bool dfps_tiles_extents (dfps_tiles_t *tiles, BoxPtr box)
+{
+    int tx1 = tiles->tiles_x, tx2 = -1, ty1 = tiles->tiles_y, ty2 = -1;
+    int tx, ty;
+
+    for (ty = 0; ty < tiles->tiles_y; ty++)
+    {
+        uint32_t *row = tiles->dirty + ty * tiles->stride;
+
+        for (tx = 0; tx < tiles->tiles_x; tx++)
+        {
+            if (!row[tx / 32])
+            {
+                tx |= 31;
+                continue;
+            }
+            if (!dfps_tile_is_dirty(tiles, tx, ty))
+                continue;
+            tx1 = MIN(tx1, tx);
+            tx2 = MAX(tx2, tx);
+            ty1 = MIN(ty1, ty);
+            ty2 = MAX(ty2, ty);
+        }
+    }
+    if (tx2 < 0)
+        return FALSE;
+
+    box->x1 = tx1 << DFPS_TILE_SHIFT;
+    box->x2 = MIN((tx2 + 1) << DFPS_TILE_SHIFT, tiles->width);
+    box->y1 = ty1 << DFPS_TILE_SHIFT;
+    box->y2 = MIN((ty2 + 1) << DFPS_TILE_SHIFT, tiles->height);
+    return TRUE;
+}
+
+/* Look for a vertical shift of the dirty area between the sent frame and
+ * the current one. When enough consecutive rows moved together, apply the
+ * move to the sent frame and re-hash the tiles it touched, so that only
+ * what differs from the moved content is uploaded afterwards, and return
+ * the rows in @dst and the shift in @dy_out for the caller to move them on
+ * the client with COPY_BITS. Horizontal motion is not detected. */
+static Bool dfps_tiles_detect_scroll (dfps_tiles_t *tiles, const uint8_t *bits,
+                                      int stride, int cpp, BoxPtr dst, int *dy_out)
+{
+    BoxRec extents;
+    int x1, x2, y1, y2, h, row_bytes;
+    int y, dy, best_dy, best_votes;
+    int run_start, best_start, best_len;
+    int tx, ty;
+
+    if (!tiles->sent || !tiles->sent_valid || cpp != tiles->cpp)
+        return FALSE;
+    if (!dfps_tiles_extents(tiles, &extents))
+        return FALSE;
+
+    x1 = extents.x1;
+    x2 = extents.x2;
+    y1 = extents.y1;
+    y2 = extents.y2;
+    h = y2 - y1;
+    row_bytes = (x2 - x1) * cpp;
+    if (h < DFPS_SCROLL_MIN_ROWS * 2)
+        return FALSE;
+
+    memset(tiles->table_rows, 0xff, (tiles->table_mask + 1) * sizeof(int));
+    for (y = y1; y < y2; y++)
+    {
+        MurmurHash3_x86_32(bits + y * stride + x1 * cpp, row_bytes, 0,
+                           &tiles->cur_rows[y]);
+        MurmurHash3_x86_32(tiles->sent + y * tiles->sent_stride + x1 * cpp,
+                           row_bytes, 0, &tiles->sent_rows[y]);
+        dfps_row_insert(tiles, tiles->sent_rows[y], y);
+    }
+
+    /* every changed row votes for the shift that explains it */
+    memset(tiles->votes, 0, h * 2 * sizeof(int));
+    for (y = y1; y < y2; y++)
+    {
+        int row;
+
+        if (tiles->cur_rows[y] == tiles->sent_rows[y])
+            continue;
+        row = dfps_row_lookup(tiles, tiles->cur_rows[y]);
+        if (row >= 0)
+            tiles->votes[y - row + h]++;
+    }
+    best_dy = 0;
+    best_votes = 0;
+    for (dy = -h + 1; dy < h; dy++)
+    {
+        if (dy != 0 && tiles->votes[dy + h] > best_votes)
+        {
+            best_votes = tiles->votes[dy + h];
+            best_dy = dy;
+        }
+    }
+    if (best_votes < DFPS_SCROLL_MIN_ROWS)
+        return FALSE;
+
+    /* longest run of rows that match the sent frame shifted by best_dy */
+    dy = best_dy;
+    best_start = best_len = 0;
+    run_start = -1;
+    for (y = MAX(y1, y1 + dy); y <= MIN(y2, y2 + dy); y++)
+    {
+        if (y < MIN(y2, y2 + dy) && tiles->cur_rows[y] == tiles->sent_rows[y - dy])
+        {
+            if (run_start < 0)
+                run_start = y;
+            continue;
+        }
+        if (run_start >= 0 && y - run_start > best_len)
+        {
+            best_start = run_start;
+            best_len = y - run_start;
+        }
+        run_start = -1;
+    }
+    if (best_len < DFPS_SCROLL_MIN_ROWS)
+        return FALSE;
+
+    /* keep the sent frame in step with the client */
+    if (dy > 0)
+    {
+        for (y = best_start + best_len - 1; y >= best_start; y--)
+            memcpy(tiles->sent + y * tiles->sent_stride + x1 * cpp,
+                   tiles->sent + (y - dy) * tiles->sent_stride + x1 * cpp,
+                   row_bytes);
+    }
+    else
+    {
+        for (y = best_start; y < best_start + best_len; y++)
+            memcpy(tiles->sent + y * tiles->sent_stride + x1 * cpp,
+                   tiles->sent + (y - dy) * tiles->sent_stride + x1 * cpp,
+                   row_bytes);
+    }
+
+    /* the moved tiles now hold different content on the client; compare
+     * them against the current frame again */
+    dfps_tiles_mark(tiles, x1, best_start, x2, best_start + best_len);
+    for (ty = best_start >> DFPS_TILE_SHIFT;
+         ty <= (best_start + best_len - 1) >> DFPS_TILE_SHIFT; ty++)
+    {
+        for (tx = x1 >> DFPS_TILE_SHIFT; tx <= (x2 - 1) >> DFPS_TILE_SHIFT; tx++)
+        {
+            uint64_t *hash = tiles->hashes + (ty * tiles->tiles_x + tx) * 2;
+
+            dfps_tile_hash(tiles, tiles->sent, tiles->sent_stride, cpp,
+                           tx, ty, hash);
+            tiles->hash_valid[ty * tiles->stride + tx / 32] |= 1U << (tx % 32);
+        }
+    }
+
+    dst->x1 = x1;
+    dst->y1 = best_start;
+    dst->x2 = x2;
+    dst->y2 = best_start + best_len;
+    *dy_out = dy;
+    return TRUE;
+}
+
+/* Copy the uploaded boxes into the sent frame. */
+static void dfps_tiles_update_sent (dfps_tiles_t *tiles, const uint8_t *bits,
+                                    int stride, int cpp,
+                                    const BoxRec *boxes, int n_boxes)
+{
+    int y;
+
+    if (!tiles->sent || cpp != tiles->cpp)
+        return;
+
+    while (n_boxes--)
+    {
+        for (y = boxes->y1; y < boxes->y2; y++)
+            memcpy(tiles->sent + y * tiles->sent_stride + boxes->x1 * cpp,
+                   bits + y * stride + boxes->x1 * cpp,
+                   (boxes->x2 - boxes->x1) * cpp);
+        boxes++;
+    }
+}
+
+/* Turn the dirty bitmap into boxes: horizontal runs of dirty tiles,
+ * merged with the run directly above when they span the same columns.
+ * Clears the bitmap and returns the number of boxes in tiles->boxes. */
+static int dfps_tiles_to_boxes (dfps_tiles_t *tiles)
+{
+    int n_boxes = 0;
+    int n_open = 0;
+    int tx, ty;
+
+    for (ty = 0; ty < tiles->tiles_y; ty++)
+    {
+        int y1 = ty << DFPS_TILE_SHIFT;
+        int y2 = MIN(y1 + DFPS_TILE_SIZE, tiles->height);
+        int n_prev = n_open;
+        int prev = 0;
+
+        n_open = 0;
+        for (tx = 0; tx < tiles->tiles_x; tx++)
+        {
+            int x1, x2;
+
+            if (!dfps_tile_is_dirty(tiles, tx, ty))
+                continue;
+
+            x1 = tx << DFPS_TILE_SHIFT;
+            while (tx + 1 < tiles->tiles_x && dfps_tile_is_dirty(tiles, tx + 1, ty))
+                tx++;
+            x2 = MIN((tx + 1) << DFPS_TILE_SHIFT, tiles->width);
+
+            /* open boxes from the row above are sorted by x1 */
+            while (prev < n_prev && tiles->boxes[tiles->open[prev]].x1 < x1)
+                prev++;
+            if (prev < n_prev && tiles->boxes[tiles->open[prev]].x1 == x1 &&
+                tiles->boxes[tiles->open[prev]].x2 == x2)
+            {
+                tiles->boxes[tiles->open[prev]].y2 = y2;
+                tiles->open[n_open++] = tiles->open[prev++];
+            }
+            else
+            {
+                tiles->boxes[n_boxes].x1 = x1;
+                tiles->boxes[n_boxes].y1 = y1;
+                tiles->boxes[n_boxes].x2 = x2;
+                tiles->boxes[n_boxes].y2 = y2;
+                tiles->open[n_open++] = n_boxes++;
+            }
+        }
+    }
+
+    memset(tiles->dirty, 0, tiles->stride * tiles->tiles_y * sizeof(uint32_t));
+    tiles->n_dirty = 0;
+    return n_boxes;
+}
+
 typedef struct FrameTimer {
     OsTimerPtr xorg_timer;
     FrameTimerFunc func;
     void *opaque; // also stored in xorg_timer, but needed for timer_start
+    Bool armed;
+    CARD32 expires;
+    CARD32 last_fire;   /* set by the ticker when it takes a frame */
 } Timer;
 
 static CARD32 xorg_timer_callback(
@@ -79,6 +730,7 @@ static CARD32 xorg_timer_callback(
 {
     FrameTimer *timer = (FrameTimer*)arg;
 
+    timer->armed = FALSE;
     timer->func(timer->opaque);
     return 0; // if non zero xorg does a TimerSet, we don't want that.
 }
@@ -95,37 +747,602 @@ static FrameTimer* timer_add(FrameTimerFunc func, void *opaque)
 
 static void timer_start(FrameTimer *timer, uint32_t ms)
 {
+    timer->armed = TRUE;
+    timer->expires = GetTimeInMillis() + ms;
     TimerSet(timer->xorg_timer, 0 /* flags */, ms, xorg_timer_callback, timer);
 }
 
+/* Pick the interval to the next frame, between 1/deferred_fps and
+ * 1/deferred_fps_min. The rate falls off linearly as the time since the
+ * last input grows from DFPS_INPUT_ACTIVE_MS to DFPS_INPUT_IDLE_MS, and
+ * falls further the more of the screen is dirty: once idle, a few dirty
+ * tiles get the rate half way between the two, a dirty screen the
+ * lowest. A session that never had input counts as idle. While the
+ * device is behind, the lowest rate is used regardless. */
+static uint32_t dfps_next_interval (qxl_screen_t *qxl, dfps_tiles_t *tiles)
+{
+    int max_fps = qxl->deferred_fps;
+    int min_fps = qxl->deferred_fps_min ? qxl->deferred_fps_min : 1;
+    int idle = 1000;    /* per mille */
+    int dirty = 0;      /* per mille of the tiles */
+    int fps;
+
+    if (qxl->last_input_time)
+    {
+        CARD32 since = GetTimeInMillis() - qxl->last_input_time;
+
+        if (since <= DFPS_INPUT_ACTIVE_MS)
+            idle = 0;
+        else if (since < DFPS_INPUT_IDLE_MS)
+            idle = (since - DFPS_INPUT_ACTIVE_MS) * 1000 /
+                (DFPS_INPUT_IDLE_MS - DFPS_INPUT_ACTIVE_MS);
+    }
+    if (tiles && tiles->tiles_x && tiles->tiles_y)
+        dirty = tiles->n_dirty * 1000 / (tiles->tiles_x * tiles->tiles_y);
+
+    /* a large frame is expensive to send, but only slows things down
+     * as far as nobody is waiting on it */
+    fps = max_fps - (max_fps - min_fps) * (idle * (1000 + dirty) / 2000) / 1000;
+
+    /* the device has not caught up with earlier frames yet */
+    if (!qxl->kms_enabled &&
+        (qxl_ring_used_percent(qxl->command_ring) > DFPS_RING_BUSY_PERCENT ||
+         qxl_mem_free_percent(qxl->mem) < DFPS_MEM_LOW_PERCENT))
+        fps = min_fps;
+
+    if (fps < min_fps)
+        fps = min_fps;
+    if (fps > max_fps)
+        fps = max_fps;
+
+    return 1000 / fps;
+}
+
+static Bool dfps_input_pending (qxl_screen_t *qxl, CARD32 now)
+{
+    return qxl->input_pending_time &&
+        now - qxl->input_pending_time < DFPS_INPUT_GRACE_MS;
+}
+
+/* Arm the frame timer if it is not already running. It is left stopped
+ * while the screen is clean. */
+static void dfps_schedule (qxl_screen_t *qxl, dfps_tiles_t *tiles)
+{
+    FrameTimer *timer = qxl->frames_timer;
+    CARD32 now = GetTimeInMillis();
+    uint32_t interval;
+    CARD32 elapsed;
+
+    if (!timer)
+        return;
+
+    if (dfps_input_pending(qxl, now))
+    {
+        /* only ever move the timer closer, or a stream of drawing would
+         * keep pushing the frame back */
+        if (!timer->armed || (int32_t)(timer->expires - (now + DFPS_INPUT_FLUSH_MS)) > 0)
+            timer_start(timer, DFPS_INPUT_FLUSH_MS);
+        return;
+    }
+    if (timer->armed)
+        return;
+
+    interval = dfps_next_interval(qxl, tiles);
+    elapsed = now - timer->last_fire;
+    timer_start(timer, elapsed < interval ? interval - elapsed : 1);
+}
+
 void dfps_start_ticker(qxl_screen_t *qxl)
 {
     qxl->frames_timer = timer_add(dfps_ticker, qxl);
+    qxl->frames_timer->last_fire = GetTimeInMillis();
     timer_start(qxl->frames_timer, 1000 / qxl->deferred_fps);
 }
 
+/* First pass on the worker: everything up to the hashes of the planned
+ * rectangles. */
+static void dfps_worker_plan (dfps_worker_t *worker)
+{
+    dfps_tiles_t *tiles = worker->tiles;
+    int i;
+
+    worker->scroll = dfps_tiles_detect_scroll(tiles, worker->capture,
+                                              worker->stride, worker->cpp,
+                                              &worker->scroll_box,
+                                              &worker->scroll_dy);
+    dfps_tiles_drop_unchanged(tiles, worker->capture, worker->stride, worker->cpp);
+    worker->n_boxes = 0;
+    worker->n_plan = 0;
+    if (tiles->n_dirty)
+    {
+        worker->n_boxes = dfps_tiles_to_boxes(tiles);
+        worker->n_plan = qxl_surface_plan_upload(worker->qxl, tiles->boxes,
+                                                 worker->n_boxes, worker->cpp,
+                                                 worker->plan);
+        dfps_tiles_update_sent(tiles, worker->capture, worker->stride,
+                               worker->cpp, worker->plan, worker->n_plan);
+        for (i = 0; i < worker->n_plan; i++)
+        {
+            BoxPtr b = &worker->plan[i];
+
+            worker->plan_hash[i] = qxl_image_hash(worker->capture, b->x1, b->y1,
+                                                  b->x2 - b->x1, b->y2 - b->y1,
+                                                  worker->stride, worker->cpp);
+        }
+    }
+    /* a new map starts all dirty, so after the first frame the client
+     * has every tile */
+    tiles->sent_valid = TRUE;
+}
+
+/* Second pass: copy the pixels into the images the X thread allocated. */
+static void dfps_worker_fill (dfps_worker_t *worker)
+{
+    int i;
+
+    for (i = 0; i < worker->n_images; i++)
+        qxl_image_fill_reserved(&worker->images[i], worker->capture,
+                                worker->plan[i].x1, worker->plan[i].y1,
+                                worker->stride, worker->cpp);
+}
+
+static void dfps_worker_signal (dfps_worker_t *worker)
+{
+    uint64_t one = 1;
+
+    /* not ErrorF, this is not the X thread; a full counter means a
+     * wakeup is pending anyway */
+    if (worker->event_fd >= 0 &&
+        write(worker->event_fd, &one, sizeof(one)) != sizeof(one) &&
+        errno != EAGAIN)
+        fprintf(stderr, "dfps: eventfd write failed: %s\n", strerror(errno));
+}
+
+static void *dfps_worker_main (void *opaque)
+{
+    dfps_worker_t *worker = opaque;
+    dfps_job_state_t state;
+
+    pthread_mutex_lock(&worker->lock);
+    for (;;)
+    {
+        while (worker->state != DFPS_JOB_PLAN &&
+               worker->state != DFPS_JOB_FILL && !worker->quit)
+            pthread_cond_wait(&worker->cond, &worker->lock);
+        if (worker->quit)
+            break;
+
+        state = worker->state;
+        pthread_mutex_unlock(&worker->lock);
+        if (state == DFPS_JOB_PLAN)
+            dfps_worker_plan(worker);
+        else
+            dfps_worker_fill(worker);
+        pthread_mutex_lock(&worker->lock);
+        worker->state = state == DFPS_JOB_PLAN ? DFPS_JOB_PLANNED : DFPS_JOB_DONE;
+        dfps_worker_signal(worker);
+    }
+    pthread_mutex_unlock(&worker->lock);
+    return NULL;
+}
+
+static dfps_job_state_t dfps_worker_state (dfps_worker_t *worker)
+{
+    dfps_job_state_t state;
+
+    pthread_mutex_lock(&worker->lock);
+    state = worker->state;
+    pthread_mutex_unlock(&worker->lock);
+    return state;
+}
+
+/* Hand the job to the worker thread for its next pass. */
+static void dfps_worker_queue (dfps_worker_t *worker, dfps_job_state_t state)
+{
+    pthread_mutex_lock(&worker->lock);
+    worker->state = state;
+    pthread_cond_signal(&worker->cond);
+    pthread_mutex_unlock(&worker->lock);
+}
+
+static void dfps_worker_event (int fd, int ready, void *opaque);
+
+static void dfps_worker_watch (dfps_worker_t *worker)
+{
+    worker->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (worker->event_fd < 0)
+        return;
+
+#if defined(DFPS_NOTIFY_FD)
+    worker->notify = SetNotifyFd(worker->event_fd, dfps_worker_event,
+                                 X_NOTIFY_READ, worker);
+#elif defined(XSPICE)
+    worker->watch = worker->qxl->core->watch_add(worker->event_fd,
+                                                 SPICE_WATCH_EVENT_READ,
+                                                 dfps_worker_event, worker);
+    worker->notify = worker->watch != NULL;
+#endif
+    if (!worker->notify)
+    {
+        close(worker->event_fd);
+        worker->event_fd = -1;
+    }
+}
+
+static void dfps_worker_unwatch (dfps_worker_t *worker)
+{
+    if (worker->event_fd < 0)
+        return;
+
+#if defined(DFPS_NOTIFY_FD)
+    RemoveNotifyFd(worker->event_fd);
+#elif defined(XSPICE)
+    worker->qxl->core->watch_remove(worker->watch);
+    worker->watch = NULL;
+#endif
+    close(worker->event_fd);
+    worker->event_fd = -1;
+    worker->notify = FALSE;
+}
+
+static void dfps_worker_destroy (dfps_worker_t *worker)
+{
+    int i;
+
+    if (!worker)
+        return;
+
+    if (worker->has_thread)
+    {
+        pthread_mutex_lock(&worker->lock);
+        worker->quit = TRUE;
+        pthread_cond_signal(&worker->cond);
+        pthread_mutex_unlock(&worker->lock);
+        pthread_join(worker->thread, NULL);
+    }
+    dfps_worker_unwatch(worker);
+
+    /* images of a frame that was never pushed */
+    for (i = 0; i < worker->n_images; i++)
+        qxl_image_destroy(worker->qxl,
+                          qxl_image_finish_reserved(worker->qxl, &worker->images[i]));
+
+    pthread_cond_destroy(&worker->cond);
+    pthread_mutex_destroy(&worker->lock);
+    dfps_tiles_free(worker->tiles);
+    free(worker->capture);
+    free(worker);
+}
+
+/* Without a thread, jobs are processed synchronously on the ticker. */
+static dfps_worker_t *dfps_worker_create (qxl_screen_t *qxl, PixmapPtr pixmap)
+{
+    int bpp = pixmap->drawable.bitsPerPixel;
+    dfps_worker_t *worker = calloc(1, sizeof(*worker));
+    sigset_t all, saved;
+
+    if (!worker)
+        return NULL;
+
+    worker->qxl = qxl;
+    worker->event_fd = -1;
+    worker->cpp = bpp == 24 ? 4 : bpp / 8;
+    worker->stride = pixmap->drawable.width * worker->cpp;
+    worker->tiles = dfps_tiles_create(pixmap->drawable.width,
+                                      pixmap->drawable.height, bpp, TRUE);
+    worker->capture = malloc(worker->stride * pixmap->drawable.height);
+    pthread_mutex_init(&worker->lock, NULL);
+    pthread_cond_init(&worker->cond, NULL);
+    if (!worker->tiles || !worker->capture)
+    {
+        dfps_worker_destroy(worker);
+        return NULL;
+    }
+
+    /* signals are for the X thread */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &saved);
+    worker->has_thread =
+        pthread_create(&worker->thread, NULL, dfps_worker_main, worker) == 0;
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    if (worker->has_thread)
+        dfps_worker_watch(worker);
+    else
+        xf86DrvMsg(qxl->pScrn->scrnIndex, X_WARNING,
+                   "Deferred FPS: no worker thread, processing frames inline\n");
+    return worker;
+}
+
+/* The capture buffer of a new worker is only filled in where tiles are
+ * dirty, so all of @live is marked. */
+static dfps_worker_t *dfps_get_worker (qxl_screen_t *qxl, PixmapPtr pixmap,
+                                       dfps_info_t *info, dfps_tiles_t *live)
+{
+    dfps_worker_t *worker = info->worker;
+
+    if (worker && worker->tiles->width == pixmap->drawable.width &&
+        worker->tiles->height == pixmap->drawable.height)
+        return worker;
+
+    /* a pending result is for the old size and is dropped */
+    dfps_worker_destroy(worker);
+    info->worker = dfps_worker_create(qxl, pixmap);
+    if (info->worker)
+        dfps_tiles_mark(live, 0, 0, live->width, live->height);
+    return info->worker;
+}
+
+/* Copy the dirty tiles of the screen into the capture buffer, a run of
+ * tiles in a row at a time, and move the dirty bitmap over to the
+ * worker's tiles. The rest of the buffer still matches the screen. */
+static void dfps_capture (dfps_worker_t *worker, dfps_tiles_t *live,
+                          PixmapPtr pixmap)
+{
+    dfps_tiles_t *tiles = worker->tiles;
+    int stride, cpp, tx, ty, y;
+    uint8_t *bits = dfps_pixmap_bits(pixmap, &stride, &cpp);
+
+    for (ty = 0; ty < live->tiles_y; ty++)
+    {
+        uint32_t *row = live->dirty + ty * live->stride;
+        int y1 = ty << DFPS_TILE_SHIFT;
+        int y2 = MIN(y1 + DFPS_TILE_SIZE, live->height);
+
+        for (tx = 0; tx < live->tiles_x; tx++)
+        {
+            int x1, x2;
+
+            if (!row[tx / 32])
+            {
+                tx |= 31;
+                continue;
+            }
+            if (!dfps_tile_is_dirty(live, tx, ty))
+                continue;
+
+            x1 = tx << DFPS_TILE_SHIFT;
+            while (tx + 1 < live->tiles_x && dfps_tile_is_dirty(live, tx + 1, ty))
+                tx++;
+            x2 = MIN((tx + 1) << DFPS_TILE_SHIFT, live->width);
+
+            for (y = y1; y < y2; y++)
+                memcpy(worker->capture + y * worker->stride + x1 * cpp,
+                       bits + y * stride + x1 * cpp, (x2 - x1) * cpp);
+        }
+    }
+
+    memcpy(tiles->dirty, live->dirty,
+           tiles->stride * tiles->tiles_y * sizeof(uint32_t));
+    tiles->n_dirty = live->n_dirty;
+    memset(live->dirty, 0, live->stride * live->tiles_y * sizeof(uint32_t));
+    live->n_dirty = 0;
+}
+
+/* Move the scrolled area on the device and allocate the images of a
+ * planned frame. */
+static void dfps_reserve (qxl_screen_t *qxl, dfps_worker_t *worker,
+                          dfps_tiles_t *live)
+{
+    if (worker->scroll)
+    {
+        BoxPtr b = &worker->scroll_box;
+
+        if (qxl_surface_prepare_copy(qxl->primary, qxl->primary))
+        {
+            qxl_surface_copy(qxl->primary, b->x1, b->y1 - worker->scroll_dy,
+                             b->x1, b->y1, b->x2 - b->x1, b->y2 - b->y1);
+            qxl_surface_flush(qxl->primary);
+        }
+        else
+        {
+            /* the worker already moved its copy of the client frame;
+             * without the move it is wrong, so start over */
+            worker->tiles->sent_valid = FALSE;
+            memset(worker->tiles->hash_valid, 0,
+                   worker->tiles->stride * worker->tiles->tiles_y * sizeof(uint32_t));
+            dfps_tiles_mark(live, 0, 0, live->width, live->height);
+        }
+    }
+
+    /* out of memory, the rest is copied by dfps_submit */
+    for (worker->n_images = 0; worker->n_images < worker->n_plan; worker->n_images++)
+    {
+        BoxPtr b = &worker->plan[worker->n_images];
+
+        if (!qxl_image_reserve(qxl, b->x2 - b->x1, b->y2 - b->y1, worker->cpp,
+                               worker->plan_hash[worker->n_images],
+                               &worker->images[worker->n_images]))
+            break;
+    }
+}
+
+/* Send the result of a finished job to the device. */
+static void dfps_submit (qxl_screen_t *qxl, dfps_worker_t *worker)
+{
+    int i;
+
+    for (i = 0; i < worker->n_plan; i++)
+    {
+        BoxPtr b = &worker->plan[i];
+        struct qxl_bo *image_bo;
+
+        if (i < worker->n_images)
+            image_bo = qxl_image_finish_reserved(qxl, &worker->images[i]);
+        else
+            image_bo = qxl_image_create(qxl, worker->capture, b->x1, b->y1,
+                                        b->x2 - b->x1, b->y2 - b->y1,
+                                        worker->stride, worker->cpp, TRUE);
+        qxl_surface_upload_primary_bo(qxl, b, image_bo);
+    }
+    worker->n_images = 0;
+
+    if (worker->input_time)
+    {
+        if (worker->n_plan || worker->scroll)
+        {
+            struct dfps_input_stats *stats = &qxl->input_stats;
+            CARD32 latency = GetTimeInMillis() - worker->input_time;
+
+            stats->samples++;
+            stats->total += latency;
+            if (latency > stats->max)
+                stats->max = latency;
+        }
+        else if (!qxl->input_pending_time)
+        {
+            /* nothing visible yet; the answer may still come */
+            qxl->input_pending_time = worker->input_time;
+        }
+        worker->input_time = 0;
+    }
+
+    if (qxl->debug_upload_plans && worker->n_boxes)
+    {
+        ErrorF("dfps frame: %d boxes -> %d rects%s\n", worker->n_boxes,
+               worker->n_plan, worker->scroll ? " after scroll" : "");
+    }
+}
+
+/* Take the X thread's turn in a job the worker has finished a pass of.
+ * Returns the state the job is left in. */
+static dfps_job_state_t dfps_worker_advance (qxl_screen_t *qxl, dfps_worker_t *worker,
+                                             dfps_tiles_t *live)
+{
+    dfps_job_state_t state = dfps_worker_state(worker);
+
+    if (state == DFPS_JOB_PLANNED)
+    {
+        dfps_reserve(qxl, worker, live);
+        if (worker->has_thread && worker->n_images)
+        {
+            dfps_worker_queue(worker, DFPS_JOB_FILL);
+            return DFPS_JOB_FILL;
+        }
+        dfps_worker_fill(worker);
+        state = DFPS_JOB_DONE;
+    }
+    if (state == DFPS_JOB_DONE)
+    {
+        dfps_submit(qxl, worker);
+        pthread_mutex_lock(&worker->lock);
+        worker->state = state = DFPS_JOB_IDLE;
+        pthread_mutex_unlock(&worker->lock);
+        /* damage that came in meanwhile waits for its own frame slot */
+        if (live->n_dirty)
+            dfps_schedule(qxl, live);
+    }
+    return state;
+}
+
+static void dfps_worker_event (int fd, int ready, void *opaque)
+{
+    dfps_worker_t *worker = opaque;
+    qxl_screen_t *qxl = worker->qxl;
+    dfps_info_t *info = NULL;
+    PixmapPtr pixmap;
+    uint64_t count;
+
+    if (read(fd, &count, sizeof(count)) != sizeof(count))
+        return;
+
+    pixmap = qxl->pScrn->pScreen->GetScreenPixmap(qxl->pScrn->pScreen);
+    if (pixmap)
+        info = dfps_get_info(pixmap);
+    if (info && info->worker == worker && info->tiles)
+        dfps_worker_advance(qxl, worker, info->tiles);
+}
+
 void dfps_ticker(void *opaque)
 {
     qxl_screen_t *qxl = (qxl_screen_t *) opaque;
     dfps_info_t *info = NULL;
+    dfps_tiles_t *tiles;
+    dfps_worker_t *worker;
     PixmapPtr pixmap;
+    CARD32 now;
 
     pixmap = qxl->pScrn->pScreen->GetScreenPixmap(qxl->pScrn->pScreen);
     if (pixmap)
         info = dfps_get_info(pixmap);
-    if (info)
+    if (!info || !(tiles = dfps_get_tiles(pixmap, info)))
+        return;
+    if (!(worker = dfps_get_worker(qxl, pixmap, info, tiles)))
     {
-        qxl_surface_upload_primary_regions(qxl, pixmap, &info->updated_region);
-        RegionUninit(&info->updated_region);
-        RegionInit(&info->updated_region, NULL, 0);
+        /* out of memory; send the dirty tiles as they are */
+        if (tiles->n_dirty)
+            qxl_surface_upload_primary_boxes(qxl, pixmap, tiles->boxes,
+                                             dfps_tiles_to_boxes(tiles));
+        return;
     }
-    timer_start(qxl->frames_timer, 1000 / qxl->deferred_fps);
+
+    if (dfps_worker_state(worker) != DFPS_JOB_IDLE)
+    {
+        /* dfps_worker_event picks the job up as each pass finishes, and
+         * schedules the next frame */
+        if (!worker->notify &&
+            dfps_worker_advance(qxl, worker, tiles) != DFPS_JOB_IDLE)
+            timer_start(qxl->frames_timer, DFPS_WORKER_POLL_MS);
+        return;
+    }
+    if (!tiles->n_dirty)
+        return;
+
+    now = GetTimeInMillis();
+    if (dfps_input_pending(qxl, now))
+    {
+        worker->input_time = qxl->input_pending_time;
+        qxl->input_stats.early_frames++;
+    }
+    qxl->input_pending_time = 0;
+    qxl->frames_timer->last_fire = now;
+    dfps_capture(worker, tiles, pixmap);
+    if (worker->has_thread)
+    {
+        dfps_worker_queue(worker, DFPS_JOB_PLAN);
+        if (!worker->notify)
+            timer_start(qxl->frames_timer, DFPS_WORKER_POLL_MS);
+    }
+    else
+    {
+        dfps_worker_plan(worker);
+        worker->state = DFPS_JOB_PLANNED;
+        dfps_worker_advance(qxl, worker, tiles);
+    }
+    /* otherwise the timer is re-armed by the next drawing operation */
 }
 
 
-static Bool unaccel (void)
+/* Called on key and button presses: damage that follows soon is sent
+ * without waiting for its frame slot. */
+void dfps_input_notify (qxl_screen_t *qxl)
 {
-    return FALSE;
+    CARD32 now = GetTimeInMillis();
+    PixmapPtr pixmap;
+    dfps_info_t *info;
+
+    if (!qxl->frames_timer)
+        return;
+
+    if (!dfps_input_pending(qxl, now))
+        qxl->input_pending_time = now ? now : 1;
+
+    /* the response may already have been drawn */
+    if (qxl->pScrn->pScreen &&
+        (pixmap = qxl->pScrn->pScreen->GetScreenPixmap(qxl->pScrn->pScreen)) &&
+        (info = dfps_get_info(pixmap)) && info->tiles && info->tiles->n_dirty)
+        dfps_schedule(qxl, info->tiles);
+}
+
+void dfps_dump_stats (qxl_screen_t *qxl)
+{
+    struct dfps_input_stats *stats = &qxl->input_stats;
+
+    if (!stats->early_frames)
+        return;
+    ErrorF("dfps: %" PRIu64 " frames sent early for input\n", stats->early_frames);
+    if (stats->samples)
+        ErrorF("  input to submit avg: %" PRIu64 " ms, max: %u ms\n",
+               stats->total / stats->samples, stats->max);
 }
 
 static Bool dfps_prepare_solid (PixmapPtr pixmap, int alu, Pixel planemask, Pixel fg)
@@ -152,9 +1369,6 @@ static Bool dfps_prepare_solid (PixmapPtr pixmap, int alu, Pixel planemask, Pixe
 
 static void dfps_solid (PixmapPtr pixmap, int x_1, int y_1, int x_2, int y_2)
 {
-    struct pixman_box16 box;
-    RegionPtr region;
-    Bool throwaway_bool;
     dfps_info_t *info;
 
     if (!(info = dfps_get_info (pixmap)))
@@ -164,12 +1378,7 @@ static void dfps_solid (PixmapPtr pixmap, int x_1, int y_1, int x_2, int y_2)
     fbFill(&pixmap->drawable, info->pgc, x_1, y_1, x_2 - x_1, y_2 - y_1);
 
     /* Track the updated region */
-    box.x1 = x_1; box.x2 = x_2; box.y1 = y_1; box.y2 = y_2;
-    region = RegionCreate(&box, 1);
-    RegionAppend(&info->updated_region, region);
-    RegionValidate(&info->updated_region, &throwaway_bool);
-    RegionUninit(region);
-    return;
+    dfps_mark(pixmap, info, x_1, y_1, x_2, y_2);
 }
 
 static void dfps_done_solid (PixmapPtr pixmap)
@@ -211,10 +1420,6 @@ static void dfps_copy (PixmapPtr dest,
           int dest_x1, int dest_y1,
           int width, int height)
 {
-    struct pixman_box16 box;
-    RegionPtr region;
-    Bool throwaway_bool;
-
     dfps_info_t *info;
 
     if (!(info = dfps_get_info (dest)))
@@ -224,11 +1429,7 @@ static void dfps_copy (PixmapPtr dest,
     fbCopyArea(&info->copy_src->drawable, &dest->drawable, info->pgc, src_x1, src_y1, width, height, dest_x1, dest_y1);
 
     /* Update the tracking region */
-    box.x1 = dest_x1; box.x2 = dest_x1 + width; box.y1 = dest_y1; box.y2 = dest_y1 + height;
-    region = RegionCreate(&box, 1);
-    RegionAppend(&info->updated_region, region);
-    RegionValidate(&info->updated_region, &throwaway_bool);
-    RegionUninit(region);
+    dfps_mark(dest, info, dest_x1, dest_y1, dest_x1 + width, dest_y1 + height);
 }
 
 static void dfps_done_copy (PixmapPtr dest)
@@ -242,26 +1443,179 @@ static void dfps_done_copy (PixmapPtr dest)
     }
 }
 
+/* Render goes straight to the frame buffer through pixman. Glyphs and
+ * trapezoids need nothing of their own: uxa rasterizes them into mask
+ * pixmaps, which are plain memory here, and composites the masks through
+ * the hooks below. */
+static Bool dfps_picture_supported (PicturePtr pict)
+{
+    if (!pict)
+        return TRUE;
+    if (pict->alphaMap)
+        return FALSE;
+    if (pict->filter == PictFilterConvolution)
+        return FALSE;
+    return TRUE;
+}
+
+static pixman_filter_t dfps_pixman_filter (int filter)
+{
+    switch (filter)
+    {
+    case PictFilterBilinear:
+        return PIXMAN_FILTER_BILINEAR;
+    case PictFilterFast:
+        return PIXMAN_FILTER_FAST;
+    case PictFilterGood:
+        return PIXMAN_FILTER_GOOD;
+    case PictFilterBest:
+        return PIXMAN_FILTER_BEST;
+    case PictFilterNearest:
+    default:
+        return PIXMAN_FILTER_NEAREST;
+    }
+}
+
+static pixman_image_t *dfps_image_from_picture (PicturePtr pict, PixmapPtr pixmap,
+                                                Bool is_source)
+{
+    pixman_image_t *image;
+    FbBits *bits;
+    FbStride stride;
+    int bpp;
+
+    fbGetPixmapBitsData(pixmap, bits, stride, bpp);
+    image = pixman_image_create_bits((pixman_format_code_t)pict->format,
+                                     pixmap->drawable.width,
+                                     pixmap->drawable.height,
+                                     (uint32_t *)bits, stride * sizeof(FbBits));
+    if (!image || !is_source)
+        return image;
+
+    if (pict->transform)
+        pixman_image_set_transform(image, (pixman_transform_t *)pict->transform);
+    pixman_image_set_repeat(image, pict->repeat ? pict->repeatType : PIXMAN_REPEAT_NONE);
+    pixman_image_set_filter(image, dfps_pixman_filter(pict->filter), NULL, 0);
+    pixman_image_set_component_alpha(image, pict->componentAlpha);
+    return image;
+}
+
+static void dfps_free_composite (dfps_info_t *info)
+{
+    if (info->composite_src)
+        pixman_image_unref(info->composite_src);
+    if (info->composite_mask)
+        pixman_image_unref(info->composite_mask);
+    if (info->composite_dst)
+        pixman_image_unref(info->composite_dst);
+    info->composite_src = NULL;
+    info->composite_mask = NULL;
+    info->composite_dst = NULL;
+}
+
+static Bool dfps_check_composite (int op, PicturePtr pSrcPicture, PicturePtr pMaskPicture,
+                                  PicturePtr pDstPicture, int width, int height)
+{
+    return dfps_picture_supported(pSrcPicture) &&
+           dfps_picture_supported(pMaskPicture) &&
+           dfps_picture_supported(pDstPicture);
+}
+
+static Bool dfps_check_composite_target (PixmapPtr pixmap)
+{
+    return !!dfps_get_info(pixmap);
+}
+
+static Bool dfps_check_composite_texture (ScreenPtr screen, PicturePtr pPicture)
+{
+    return dfps_picture_supported(pPicture);
+}
+
+static Bool dfps_prepare_composite (int op, PicturePtr pSrcPicture, PicturePtr pMaskPicture,
+                                    PicturePtr pDstPicture, PixmapPtr pSrc, PixmapPtr pMask,
+                                    PixmapPtr pDst)
+{
+    dfps_info_t *info;
+
+    if (!(info = dfps_get_info (pDst)))
+        return FALSE;
+
+    /* uxa turns solid and gradient sources into pixmaps before getting
+     * here; anything else is left to the fallback */
+    if (!pSrc || (pMaskPicture && !pMask))
+        return FALSE;
+
+    info->composite_op = op;
+    info->composite_src = dfps_image_from_picture(pSrcPicture, pSrc, TRUE);
+    if (pMaskPicture)
+        info->composite_mask = dfps_image_from_picture(pMaskPicture, pMask, TRUE);
+    info->composite_dst = dfps_image_from_picture(pDstPicture, pDst, FALSE);
+
+    if (!info->composite_src || !info->composite_dst ||
+        (pMaskPicture && !info->composite_mask))
+    {
+        dfps_free_composite(info);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static void dfps_composite (PixmapPtr pDst, int src_x, int src_y, int mask_x, int mask_y,
+                            int dst_x, int dst_y, int width, int height)
+{
+    dfps_info_t *info;
+
+    if (!(info = dfps_get_info (pDst)))
+        return;
+
+    pixman_image_composite(info->composite_op,
+                           info->composite_src, info->composite_mask,
+                           info->composite_dst,
+                           src_x, src_y, mask_x, mask_y,
+                           dst_x, dst_y, width, height);
+
+    dfps_mark(pDst, info, dst_x, dst_y, dst_x + width, dst_y + height);
+}
+
+static void dfps_done_composite (PixmapPtr pDst)
+{
+    dfps_info_t *info;
+
+    if ((info = dfps_get_info (pDst)))
+        dfps_free_composite(info);
+}
+
 static Bool dfps_put_image (PixmapPtr dest, int x, int y, int w, int h,
                char *src, int src_pitch)
 {
-    struct pixman_box16 box;
-    RegionPtr region;
-    Bool throwaway_bool;
     dfps_info_t *info;
+    FbBits *data;
+    FbStride stride;
+    int bpp;
+    uint8_t *dst;
+    int row_bytes;
 
     if (!(info = dfps_get_info (dest)))
         return FALSE;
 
-    box.x1 = x; box.x2 = x + w; box.y1 = y; box.y2 = y + h;
-    region = RegionCreate(&box, 1);
-    RegionAppend(&info->updated_region, region);
-    RegionValidate(&info->updated_region, &throwaway_bool);
-    RegionUninit(region);
+    fbGetPixmapBitsData(dest, data, stride, bpp);
+    if (bpp < 8)
+        return FALSE;
+
+    /* uxa only gets here for plain GXcopy with a full planemask and has
+     * already clipped the box, so this is a straight row copy; memcpy is
+     * already vectorised by the C library */
+    dfps_mark(dest, info, x, y, x + w, y + h);
 
-    /* We can avoid doing the put image ourselves, as the uxa driver
-       will fall back and do it for us if we return false */
-    return FALSE;
+    row_bytes = w * (bpp / 8);
+    dst = (uint8_t *)data + y * stride * sizeof(FbBits) + x * (bpp / 8);
+    while (h--)
+    {
+        memcpy(dst, src, row_bytes);
+        dst += stride * sizeof(FbBits);
+        src += src_pitch;
+    }
+    return TRUE;
 }
 
 
@@ -271,12 +1625,24 @@ static Bool dfps_prepare_access (PixmapPtr pixmap, RegionPtr region, uxa_access_
     if (requested_access == UXA_ACCESS_RW)
     {
         dfps_info_t *info;
-        Bool throwaway_bool;
+        dfps_tiles_t *tiles;
+        BoxPtr boxes;
+        int n_boxes;
 
         if (!(info = dfps_get_info (pixmap)))
             return FALSE;
-        RegionAppend(&info->updated_region, region);
-        RegionValidate(&info->updated_region, &throwaway_bool);
+        if ((tiles = dfps_get_tiles(pixmap, info)))
+        {
+            n_boxes = RegionNumRects(region);
+            boxes = RegionRects(region);
+            while (n_boxes--)
+            {
+                dfps_tiles_mark(tiles, boxes->x1, boxes->y1, boxes->x2, boxes->y2);
+                boxes++;
+            }
+            dfps_schedule(xf86ScreenToScrn(pixmap->drawable.pScreen)->driverPrivate,
+                          tiles);
+        }
     }
     return TRUE;
 }
@@ -304,7 +1670,6 @@ static PixmapPtr dfps_create_pixmap (ScreenPtr screen, int w, int h, int depth,
     info = calloc(1, sizeof(*info));
     if (!info)
         return FALSE;
-    RegionInit(&info->updated_region, NULL, 0);
 
     pixmap = fbCreatePixmap (screen, w, h, depth, usage);
     if (pixmap)
@@ -321,7 +1686,12 @@ static Bool dfps_destroy_pixmap (PixmapPtr pixmap)
     {
         dfps_info_t *info = dfps_get_info (pixmap);
         if (info)
+        {
+            dfps_worker_destroy(info->worker);
+            dfps_tiles_free(info->tiles);
+            dfps_free_composite(info);
             free(info);
+        }
         dfps_set_info(pixmap, NULL);
     }
 
@@ -343,12 +1713,12 @@ void dfps_set_uxa_functions(qxl_screen_t *qxl, ScreenPtr screen)
     qxl->uxa->done_copy = dfps_done_copy;
 
     /* Composite */
-    qxl->uxa->check_composite = (typeof(qxl->uxa->check_composite))unaccel;
-    qxl->uxa->check_composite_target = (typeof(qxl->uxa->check_composite_target))unaccel;
-    qxl->uxa->check_composite_texture = (typeof(qxl->uxa->check_composite_texture))unaccel;
-    qxl->uxa->prepare_composite = (typeof(qxl->uxa->prepare_composite))unaccel;
-    qxl->uxa->composite = (typeof(qxl->uxa->composite))unaccel;
-    qxl->uxa->done_composite = (typeof(qxl->uxa->done_composite))unaccel;
+    qxl->uxa->check_composite = dfps_check_composite;
+    qxl->uxa->check_composite_target = dfps_check_composite_target;
+    qxl->uxa->check_composite_texture = dfps_check_composite_texture;
+    qxl->uxa->prepare_composite = dfps_prepare_composite;
+    qxl->uxa->composite = dfps_composite;
+    qxl->uxa->done_composite = dfps_done_composite;
     
     /* PutImage */
     qxl->uxa->put_image = dfps_put_image;
@@ -364,3 +1734,221 @@ void dfps_set_uxa_functions(qxl_screen_t *qxl, ScreenPtr screen)
     screen->CreatePixmap = dfps_create_pixmap;
     screen->DestroyPixmap = dfps_destroy_pixmap;
 }
+
+/*
+ * Hybrid mode
+ *
+ * With SpiceHybridFPS set, drawing is normally forwarded to the device as
+ * QXL commands. When the rate of drawing operations, the command ring or
+ * device memory show that the device cannot keep up, the primary surface
+ * switches to deferred mode: the host copy becomes authoritative, drawing
+ * to it falls back to software, and the damage is uploaded at most
+ * hybrid_fps times per second. Once load has stayed low for a while the
+ * damage is flushed and forwarding resumes.
+ */
+#define DFPS_HYBRID_SAMPLE_MS           100
+#define DFPS_HYBRID_ENTER_OPS           3000    /* per second */
+#define DFPS_HYBRID_LEAVE_OPS           1000
+#define DFPS_HYBRID_ENTER_RING_PERCENT  80
+#define DFPS_HYBRID_LEAVE_RING_PERCENT  30
+#define DFPS_HYBRID_ENTER_MEM_PERCENT   10
+#define DFPS_HYBRID_LEAVE_MEM_PERCENT   25
+#define DFPS_HYBRID_ENTER_SAMPLES       3
+#define DFPS_HYBRID_LEAVE_SAMPLES       10
+
+struct dfps_hybrid
+{
+    Bool            active;
+    dfps_tiles_t   *tiles;
+    FrameTimer     *timer;
+
+    CARD32          sample_time;
+    uint32_t        sample_ops;
+    int             overloaded;     /* consecutive overloaded samples */
+    int             calm;           /* consecutive calm samples */
+
+    uint32_t        n_entered;
+};
+
+static void dfps_hybrid_flush (qxl_screen_t *qxl)
+{
+    struct dfps_hybrid *hybrid = qxl->hybrid;
+    int n_boxes;
+
+    if (!hybrid->tiles || !hybrid->tiles->n_dirty)
+        return;
+
+    /* the whole host copy is current, so merged boxes may cover clean
+     * tiles */
+    n_boxes = dfps_tiles_to_boxes(hybrid->tiles);
+    qxl_surface_upload_boxes(qxl->primary, "hybrid flush", NULL,
+                             hybrid->tiles->boxes, n_boxes);
+}
+
+static void dfps_hybrid_enter (qxl_screen_t *qxl)
+{
+    struct dfps_hybrid *hybrid = qxl->hybrid;
+    qxl_surface_t *primary = qxl->primary;
+    int w = pixman_image_get_width(primary->host_image);
+    int h = pixman_image_get_height(primary->host_image);
+
+    if (!hybrid->tiles || hybrid->tiles->width != w || hybrid->tiles->height != h)
+    {
+        dfps_tiles_free(hybrid->tiles);
+        hybrid->tiles = dfps_tiles_create(w, h, primary->bpp, FALSE);
+        if (!hybrid->tiles)
+            return;
+    }
+    memset(hybrid->tiles->dirty, 0,
+           hybrid->tiles->stride * hybrid->tiles->tiles_y * sizeof(uint32_t));
+    hybrid->tiles->n_dirty = 0;
+
+    /* from here on the host copy is the reference */
+    qxl_download_box(primary, 0, 0, w, h);
+
+    hybrid->active = TRUE;
+    hybrid->calm = 0;
+    hybrid->n_entered++;
+    timer_start(hybrid->timer, 1000 / qxl->hybrid_fps);
+
+    xf86DrvMsg(qxl->pScrn->scrnIndex, X_INFO,
+               "hybrid: deferring primary updates (%u times so far)\n",
+               hybrid->n_entered);
+}
+
+void dfps_hybrid_leave (qxl_screen_t *qxl)
+{
+    struct dfps_hybrid *hybrid = qxl->hybrid;
+
+    if (!hybrid || !hybrid->active)
+        return;
+
+    dfps_hybrid_flush(qxl);
+    hybrid->active = FALSE;
+    hybrid->overloaded = 0;
+
+    xf86DrvMsg(qxl->pScrn->scrnIndex, X_INFO, "hybrid: forwarding again\n");
+}
+
+static void dfps_hybrid_sample (qxl_screen_t *qxl)
+{
+    struct dfps_hybrid *hybrid = qxl->hybrid;
+    CARD32 now = GetTimeInMillis();
+    CARD32 elapsed = now - hybrid->sample_time;
+    uint32_t rate;
+    int ring, mem;
+
+    if (elapsed < DFPS_HYBRID_SAMPLE_MS)
+        return;
+
+    rate = (uint64_t)hybrid->sample_ops * 1000 / elapsed;
+    hybrid->sample_ops = 0;
+    hybrid->sample_time = now;
+    ring = qxl_ring_used_percent(qxl->command_ring);
+    mem = qxl_mem_free_percent(qxl->mem);
+
+    if (!hybrid->active)
+    {
+        if (rate > DFPS_HYBRID_ENTER_OPS ||
+            ring > DFPS_HYBRID_ENTER_RING_PERCENT ||
+            mem < DFPS_HYBRID_ENTER_MEM_PERCENT)
+            hybrid->overloaded++;
+        else
+            hybrid->overloaded = 0;
+
+        /* switching in the middle of a software fallback would lose the
+         * pixels being drawn; wait for the next sample */
+        if (hybrid->overloaded >= DFPS_HYBRID_ENTER_SAMPLES &&
+            REGION_NIL(&qxl->primary->access_region))
+            dfps_hybrid_enter(qxl);
+    }
+    else
+    {
+        if (rate < DFPS_HYBRID_LEAVE_OPS &&
+            ring < DFPS_HYBRID_LEAVE_RING_PERCENT &&
+            mem > DFPS_HYBRID_LEAVE_MEM_PERCENT)
+            hybrid->calm++;
+        else
+            hybrid->calm = 0;
+
+        if (hybrid->calm >= DFPS_HYBRID_LEAVE_SAMPLES &&
+            REGION_NIL(&qxl->primary->access_region))
+            dfps_hybrid_leave(qxl);
+    }
+}
+
+static void dfps_hybrid_ticker (void *opaque)
+{
+    qxl_screen_t *qxl = opaque;
+    struct dfps_hybrid *hybrid = qxl->hybrid;
+
+    if (!hybrid->active)
+        return;
+
+    dfps_hybrid_flush(qxl);
+    dfps_hybrid_sample(qxl);
+    if (hybrid->active)
+        timer_start(hybrid->timer, 1000 / qxl->hybrid_fps);
+}
+
+void dfps_hybrid_init (qxl_screen_t *qxl)
+{
+    struct dfps_hybrid *hybrid = calloc(1, sizeof(*hybrid));
+
+    if (!hybrid)
+        return;
+
+    hybrid->timer = timer_add(dfps_hybrid_ticker, qxl);
+    if (!hybrid->timer)
+    {
+        free(hybrid);
+        return;
+    }
+    hybrid->sample_time = GetTimeInMillis();
+    qxl->hybrid = hybrid;
+}
+
+/* Called for every accelerated drawing operation that is attempted.
+ * Only counts it: switching modes here could start an operation in one
+ * mode and finish it in the other. */
+void dfps_hybrid_note_op (qxl_screen_t *qxl)
+{
+    if (!qxl->hybrid)
+        return;
+
+    qxl->hybrid->sample_ops++;
+}
+
+/* Called from the block handler, between operations, to switch modes
+ * when the load calls for it. */
+void dfps_hybrid_check (qxl_screen_t *qxl)
+{
+    if (!qxl->hybrid || !qxl->primary)
+        return;
+
+    dfps_hybrid_sample(qxl);
+}
+
+Bool dfps_hybrid_owns (qxl_surface_t *surface)
+{
+    qxl_screen_t *qxl;
+
+    if (!surface)
+        return FALSE;
+
+    qxl = surface->qxl;
+    return qxl->hybrid && qxl->hybrid->active && surface == qxl->primary;
+}
+
+void dfps_hybrid_damage (qxl_screen_t *qxl, RegionPtr region)
+{
+    dfps_tiles_t *tiles = qxl->hybrid->tiles;
+    BoxPtr boxes = RegionRects(region);
+    int n_boxes = RegionNumRects(region);
+
+    while (n_boxes--)
+    {
+        dfps_tiles_mark(tiles, boxes->x1, boxes->y1, boxes->x2, boxes->y2);
+        boxes++;
+    }
+}
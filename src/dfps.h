@@ -25,3 +25,12 @@
 void dfps_start_ticker(qxl_screen_t *qxl);
 void dfps_ticker(void *opaque);
 void dfps_set_uxa_functions(qxl_screen_t *qxl, ScreenPtr screen);
+void dfps_input_notify(qxl_screen_t *qxl);
+void dfps_dump_stats(qxl_screen_t *qxl);
+
+void dfps_hybrid_init(qxl_screen_t *qxl);
+void dfps_hybrid_leave(qxl_screen_t *qxl);
+void dfps_hybrid_note_op(qxl_screen_t *qxl);
+void dfps_hybrid_check(qxl_screen_t *qxl);
+Bool dfps_hybrid_owns(qxl_surface_t *surface);
+void dfps_hybrid_damage(qxl_screen_t *qxl, RegionPtr region);
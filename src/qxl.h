@@ -108,6 +108,43 @@ typedef struct
 
 typedef struct qxl_surface_t qxl_surface_t;
 
+/* Boxes of the solid, copy or composite operation in progress; see
+ * qxl_surface_flush. */
+#define QXL_BATCH_MAX_BOXES	128
+
+struct qxl_batch
+{
+    qxl_surface_t *	dest;
+    int			type;		/* QXL_DRAW_FILL, _COPY or _COMPOSITE */
+    int			src_dx, src_dy;
+    int			mask_dx, mask_dy;
+    int			n_boxes;
+    BoxRec		extents;
+    BoxRec		boxes[QXL_BATCH_MAX_BOXES];
+};
+
+/* Recently used composite transforms, see get_transform() */
+#define QXL_TRANSFORM_CACHE_SIZE 16
+
+struct qxl_transform_entry
+{
+    struct qxl_bo *	bo;		/* one reference held by the cache */
+    pixman_fixed_t	matrix[6];
+    uint32_t		last_used;
+};
+
+/* Drawables held back until the block handler (UMS only), so that the
+ * ones painted over before then are never sent; see qxl_flush_pending. */
+#define QXL_PENDING_MAX		64
+
+struct qxl_pending
+{
+    struct qxl_bo *	bo;
+    uint32_t		surface_id;
+    struct QXLRect	bbox;
+    Bool		pinned;		/* read by a later drawable */
+};
+
 /*
  * Config Options
  */
@@ -119,6 +156,13 @@ enum {
     OPTION_DEBUG_RENDER_FALLBACKS,
     OPTION_NUM_HEADS,
     OPTION_SPICE_DEFERRED_FPS,
+    OPTION_SPICE_DEFERRED_FPS_MIN,
+    OPTION_SPICE_HYBRID_FPS,
+    OPTION_UPLOAD_COMMAND_COST,
+    OPTION_UPLOAD_BYTE_COST,
+    OPTION_DEBUG_UPLOAD_PLANS,
+    OPTION_PIXMAP_PROMOTE_SCORE,
+    OPTION_PIXMAP_DEMOTE_SCORE,
 #ifdef XSPICE
     OPTION_SPICE_PORT,
     OPTION_SPICE_TLS_PORT,
@@ -147,6 +191,7 @@ enum {
     OPTION_SPICE_VDAGENT_ENABLED,
     OPTION_SPICE_VDAGENT_VIRTIO_PATH,
     OPTION_SPICE_VDAGENT_UINPUT_PATH,
+    OPTION_SPICE_RELEASE_DEADLINE,
 #endif
     OPTION_COUNT,
 };
@@ -298,6 +343,10 @@ struct _qxl_screen_t
 
     surface_cache_t *		surface_cache;
 
+    /* Surfaces with a host image, see qxl_surface_alloc_host_image() */
+    qxl_surface_t *		host_images;
+    CARD32			host_images_swept;
+
     /* Evacuated surfaces are stored here during VT switches */
     void *			vt_surfaces;
 
@@ -307,6 +356,39 @@ struct _qxl_screen_t
     int				enable_fallback_cache;
     int				enable_surfaces;
     int                         debug_render_fallbacks;
+
+    /* Weights used when merging boxes to upload: a rectangle costs
+     * upload_cmd_cost plus upload_byte_cost per byte it covers. */
+    int				upload_cmd_cost;
+    int				upload_byte_cost;
+    int				debug_upload_plans;
+
+    /* Pixmaps start in host memory and get a device surface once their
+     * score, +1 per accelerated operation and -1 per fallback, reaches
+     * pixmap_promote_score; they go back when it drops to
+     * -pixmap_demote_score. A promote score of 0 creates surfaces along
+     * with the pixmaps. */
+    int				pixmap_promote_score;
+    int				pixmap_demote_score;
+    PixmapPtr			copy_host_src;	/* source of the copy in
+						 * progress, if in host memory */
+    Bool			composite_fill;	/* composite in progress is
+						 * sent as a solid fill */
+    struct qxl_pixmap_stats {
+	uint64_t		host_created;
+	uint64_t		promoted;
+	uint64_t		promote_failed;
+	uint64_t		demoted;
+	uint64_t		host_copies;	/* boxes copied with put_image */
+	uint64_t		composite_fills; /* solid source composites
+						  * sent as fills */
+    } pixmap_stats;
+
+    struct qxl_batch		batch;
+    struct qxl_transform_entry	transform_cache[QXL_TRANSFORM_CACHE_SIZE];
+    uint32_t			transform_clock;
+    struct qxl_pending		pending[QXL_PENDING_MAX];
+    int				n_pending;
     
     FrameTimer *        frames_timer;
 
@@ -329,6 +411,35 @@ struct _qxl_screen_t
     uint32_t           oom_running;
     uint32_t           num_free_res; /* is having a release ring effective
                                         for Xspice? */
+    /* Signalled by the worker when it pushes releases, drained
+     * by the X thread which then collects the released resources */
+    int                release_event_fd;
+    SpiceWatch        *release_watch;
+    /* release_gen is bumped under release_lock whenever the worker
+     * has pushed releases or finished handling an OOM request */
+    pthread_mutex_t    release_lock;
+    pthread_cond_t     release_cond;
+    uint32_t           release_gen;
+
+    /* Adaptive release batching, worker thread only except for
+     * release_deadline which is configuration */
+    uint32_t           release_deadline; /* ms */
+    uint64_t           release_first;    /* ns, oldest held resource */
+    uint64_t           release_rate_stamp;
+    uint32_t           release_rate_count;
+    uint32_t           release_rate;     /* releases per second */
+    struct qxl_release_stats {
+        uint64_t       batches;
+        uint64_t       resources;
+        uint64_t       sizes[5];         /* 1, 2-7, 8-31, 32-127, 128+ */
+        uint32_t       max_batch;
+        uint64_t       by_size;
+        uint64_t       by_deadline;
+        uint64_t       by_idle;
+        uint64_t       by_flush;
+        uint64_t       hold_total;       /* ns */
+        uint64_t       hold_max;         /* ns */
+    } release_stats;
     /* This is only touched from red worker thread - do not access
      * from Xorg threads. */
     struct guest_primary {
@@ -345,6 +456,17 @@ struct _qxl_screen_t
 #endif /* XSPICE */
 
     uint32_t deferred_fps;
+    uint32_t deferred_fps_min;
+    CARD32 last_input_time;     /* GetTimeInMillis() of the last input event, 0 if unknown */
+    CARD32 input_pending_time;  /* first key or button press no frame has answered yet, 0 if none */
+    struct dfps_input_stats {
+        uint64_t       early_frames;
+        uint64_t       samples;
+        uint64_t       total;           /* ms */
+        uint32_t       max;             /* ms */
+    } input_stats;
+    uint32_t hybrid_fps;
+    struct dfps_hybrid *hybrid;
     xorg_list_t ums_bos;
     struct qxl_bo_funcs *bo_funcs;
 
@@ -428,6 +550,7 @@ void              qxl_ring_request_notify (struct qxl_ring *ring);
 
 int               qxl_ring_prod        (struct qxl_ring        *ring);
 int               qxl_ring_cons        (struct qxl_ring        *ring);
+int               qxl_ring_used_percent (struct qxl_ring       *ring);
 
 /*
  * Surface
@@ -459,6 +582,14 @@ void		    qxl_surface_recycle (surface_cache_t *cache, uint32_t id);
 /* send anything pending to the other side */
 void		    qxl_surface_flush (qxl_surface_t *surface);
 
+/* forget the cached transforms; with @release the device memory is still
+ * in use and their references are dropped */
+void		    qxl_surface_reset_transform_cache (qxl_screen_t *qxl,
+						       Bool release);
+
+/* free the host images that fallbacks have not used for a while */
+void		    qxl_surface_expire_host_images (qxl_screen_t *qxl);
+
 /* access */
 Bool		    qxl_surface_prepare_access (qxl_surface_t *surface,
 						PixmapPtr      pixmap,
@@ -466,6 +597,7 @@ Bool		    qxl_surface_prepare_access (qxl_surface_t *surface,
 						uxa_access_t   access);
 void		    qxl_surface_finish_access (qxl_surface_t *surface,
 					       PixmapPtr      pixmap);
+Bool		    qxl_surface_has_access (qxl_surface_t *surface);
 
 /* solid */
 Bool		    qxl_surface_prepare_solid (qxl_surface_t *destination,
@@ -486,6 +618,9 @@ void		    qxl_surface_copy	     (qxl_surface_t *dest,
 Bool		    qxl_surface_put_image    (qxl_surface_t *dest,
 					      int x, int y, int width, int height,
 					      const char *src, int src_pitch);
+Bool		    qxl_surface_get_image    (qxl_surface_t *src,
+					      int x, int y, int width, int height,
+					      char *dst, int dst_pitch);
 void		    qxl_surface_unref        (surface_cache_t *cache,
 					      uint32_t surface_id);
 
@@ -511,6 +646,8 @@ extern int uxa_pixmap_index;
 #endif
 Bool
 qxl_uxa_init (qxl_screen_t *qxl, ScreenPtr screen);
+void
+qxl_uxa_dump_stats (qxl_screen_t *qxl);
 
 static inline qxl_surface_t *get_surface (PixmapPtr pixmap)
 {
@@ -534,6 +671,11 @@ get_ram_header (qxl_screen_t *qxl)
 }
 
 void qxl_surface_upload_primary_regions(qxl_screen_t *qxl, PixmapPtr pixmap, RegionRec *r);
+void qxl_surface_upload_primary_boxes(qxl_screen_t *qxl, PixmapPtr pixmap, BoxPtr boxes, int n_boxes);
+#define QXL_UPLOAD_PLAN_MAX 256
+int qxl_surface_plan_upload(qxl_screen_t *qxl, const BoxRec *boxes, int n_boxes, int cpp, BoxPtr plan);
+void qxl_surface_upload_boxes(qxl_surface_t *surface, const char *what, RegionPtr valid, const BoxRec *boxes, int n_boxes);
+void qxl_surface_upload_primary_bo(qxl_screen_t *qxl, BoxPtr b, struct qxl_bo *image_bo);
 
 /* ums randr code */
 void qxl_init_randr (ScrnInfoPtr pScrn, qxl_screen_t *qxl);
@@ -557,6 +699,46 @@ struct qxl_bo *qxl_image_create     (qxl_screen_t           *qxl,
 				       int                     stride,
 				       int                     Bpp,
 				       Bool		       fallback);
+/* An image allocated on the X thread whose pixels are copied in later,
+ * possibly by another thread. See qxl_image_reserve(). */
+struct qxl_image_chunk_map
+{
+    struct qxl_bo *		bo;
+    uint8_t *			data;	/* mapped until the image is finished */
+    int				n_lines;
+};
+
+struct qxl_image_reservation
+{
+    struct qxl_bo *		image_bo;
+    int				width;
+    int				height;
+    int				stride;	/* of the chunk data */
+    int				n_chunks;
+    struct qxl_image_chunk_map *chunks;
+};
+
+Bool		  qxl_image_reserve    (qxl_screen_t           *qxl,
+				        int                     width,
+				        int                     height,
+				        int                     Bpp,
+				        uint32_t                hash,
+				        struct qxl_image_reservation *reserve);
+void		  qxl_image_fill_reserved (const struct qxl_image_reservation *reserve,
+				        const uint8_t          *data,
+				        int                     x,
+				        int                     y,
+				        int                     stride,
+				        int                     Bpp);
+struct qxl_bo *qxl_image_finish_reserved (qxl_screen_t        *qxl,
+				        struct qxl_image_reservation *reserve);
+uint32_t          qxl_image_hash       (const uint8_t          *data,
+				        int                     x,
+				        int                     y,
+				        int                     width,
+				        int                     height,
+				        int                     stride,
+				        int                     Bpp);
 void              qxl_image_destroy    (qxl_screen_t           *qxl,
 				        struct qxl_bo *bo);
 void		  qxl_drop_image_cache (qxl_screen_t	       *qxl);
@@ -571,11 +753,14 @@ struct qxl_mem *  qxl_mem_create       (void                   *base,
 					unsigned long           n_bytes);
 void              qxl_mem_dump_stats   (struct qxl_mem         *mem,
 					const char             *header);
+int               qxl_mem_free_percent (struct qxl_mem         *mem);
 void              qxl_mem_free_all     (struct qxl_mem         *mem);
 void *            qxl_allocnf          (qxl_screen_t           *qxl,
 					unsigned long           size,
 					const char *            name);
 int		   qxl_garbage_collect (qxl_screen_t *qxl);
+int		   qxl_garbage_collect_bounded (qxl_screen_t *qxl, int budget);
+void		   qxl_flush_pending (qxl_screen_t *qxl);
 
 void qxl_reset_and_create_mem_slots (qxl_screen_t *qxl);
 void qxl_mark_mem_unverifiable (qxl_screen_t *qxl);
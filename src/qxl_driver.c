@@ -86,6 +86,20 @@ const OptionInfoRec DefaultOptions[] =
       "NumHeads",                 OPTV_INTEGER, { 4 }, FALSE },
     { OPTION_SPICE_DEFERRED_FPS,
       "SpiceDeferredFPS",         OPTV_INTEGER, { 0 }, FALSE},
+    { OPTION_SPICE_DEFERRED_FPS_MIN,
+      "SpiceDeferredFPSMin",      OPTV_INTEGER, { 0 }, FALSE},
+    { OPTION_SPICE_HYBRID_FPS,
+      "SpiceHybridFPS",           OPTV_INTEGER, { 0 }, FALSE},
+    { OPTION_UPLOAD_COMMAND_COST,
+      "UploadCommandCost",        OPTV_INTEGER, { 8192 }, FALSE},
+    { OPTION_UPLOAD_BYTE_COST,
+      "UploadByteCost",           OPTV_INTEGER, { 1 }, FALSE},
+    { OPTION_DEBUG_UPLOAD_PLANS,
+      "DebugUploadPlans",         OPTV_BOOLEAN, { 0 }, FALSE},
+    { OPTION_PIXMAP_PROMOTE_SCORE,
+      "PixmapPromoteScore",       OPTV_INTEGER, { 2 }, FALSE},
+    { OPTION_PIXMAP_DEMOTE_SCORE,
+      "PixmapDemoteScore",        OPTV_INTEGER, { 10 }, FALSE},
 #ifdef XSPICE
     { OPTION_SPICE_PORT,
       "SpicePort",                OPTV_INTEGER,   {5900}, FALSE },
@@ -142,6 +156,8 @@ const OptionInfoRec DefaultOptions[] =
       "SpiceVdagentVirtioPath",   OPTV_STRING,    {.str = spice_vdagent_virtio_path_default}, FALSE},
     { OPTION_SPICE_VDAGENT_UINPUT_PATH,
       "SpiceVdagentUinputPath",   OPTV_STRING,    {.str = spice_vdagent_uinput_path_default}, FALSE},
+    { OPTION_SPICE_RELEASE_DEADLINE,
+      "SpiceReleaseDeadline",     OPTV_INTEGER,   {20}, FALSE},
 #endif
     
     { -1, NULL, OPTV_NONE, {0}, FALSE }
@@ -279,6 +295,7 @@ qxl_unmap_memory (qxl_screen_t *qxl)
     {
 	qxl_mem_free_all (qxl->mem);
 	qxl_drop_image_cache (qxl);
+	qxl_surface_reset_transform_cache (qxl, FALSE);
 	free(qxl->mem);
 	qxl->mem = NULL;
     }
@@ -346,10 +363,12 @@ qxl_resize_surface0 (qxl_screen_t *qxl, long surface0_size)
 	void *surfaces;
 	qxl_dump_ring_stat (qxl);
 	qxl_io_flush_surfaces (qxl);
+	dfps_hybrid_leave (qxl);
 	surfaces = qxl_surface_cache_evacuate_all (qxl->surface_cache);
 	qxl_io_destroy_all_surfaces (qxl); // redundant?
 	qxl_io_flush_release (qxl);
 	qxl_drop_image_cache (qxl);
+	qxl_surface_reset_transform_cache (qxl, TRUE);
 	qxl_dump_ring_stat (qxl);
 	qxl_surface_cache_replace_all (qxl->surface_cache, surfaces);
 #else
@@ -439,6 +458,37 @@ qxl_restore_state (ScrnInfoPtr pScrn)
 
 #endif /* XSPICE */
 
+/* Drawables are held back in qxl_bo_write_command until the server is
+ * about to wait for clients again. No drawing operation is in progress
+ * here, so this is also where the hybrid mode may switch. */
+#if XORG_VERSION_CURRENT >= XORG_VERSION_NUMERIC(1, 19, 0, 0, 0)
+static void
+qxl_block_handler (void *data, void *timeout)
+{
+    dfps_hybrid_check (data);
+    qxl_flush_pending (data);
+    qxl_surface_expire_host_images (data);
+}
+
+static void
+qxl_wakeup_handler (void *data, int result)
+{
+}
+#else
+static void
+qxl_block_handler (pointer data, OSTimePtr timeout, pointer readmask)
+{
+    dfps_hybrid_check (data);
+    qxl_flush_pending (data);
+    qxl_surface_expire_host_images (data);
+}
+
+static void
+qxl_wakeup_handler (pointer data, int result, pointer readmask)
+{
+}
+#endif
+
 static Bool
 qxl_close_screen (CLOSE_SCREEN_ARGS_DECL)
 {
@@ -456,8 +506,19 @@ qxl_close_screen (CLOSE_SCREEN_ARGS_DECL)
     pScreen->CreateScreenResources = qxl->create_screen_resources;
     pScreen->CloseScreen = qxl->close_screen;
     
+    qxl_flush_pending (qxl);
     result = pScreen->CloseScreen (CLOSE_SCREEN_ARGS);
+
+    RemoveBlockAndWakeupHandlers (qxl_block_handler, qxl_wakeup_handler, qxl);
     
+#ifdef XSPICE
+    spiceqxl_display_dump_stats (qxl);
+#endif
+    if (qxl->deferred_fps)
+	dfps_dump_stats (qxl);
+    else
+	qxl_uxa_dump_stats (qxl);
+
 #ifndef XSPICE
     if (!xf86IsPrimaryPci (qxl->pci) && qxl->primary)
 	qxl_reset_and_create_mem_slots (qxl);
@@ -470,6 +531,10 @@ qxl_close_screen (CLOSE_SCREEN_ARGS_DECL)
 	qxl_unmap_memory (qxl);
     }
     pScrn->vtSema = FALSE;
+
+#ifdef XSPICE
+    spiceqxl_display_close_release_event (qxl);
+#endif
     
     return result;
 }
@@ -544,6 +609,7 @@ qxl_resize_primary_to_virtual (qxl_screen_t *qxl)
     
     if (qxl->primary)
     {
+	dfps_hybrid_leave (qxl);
 	qxl_surface_kill (qxl->primary);
 	qxl_surface_cache_sanity_check (qxl->surface_cache);
 	qxl->bo_funcs->destroy_primary(qxl, qxl->primary_bo);
@@ -647,6 +713,7 @@ spiceqxl_screen_init (ScrnInfoPtr pScrn, qxl_screen_t *qxl)
 	qxl->core = basic_event_loop_init ();
 	spice_server_init (qxl->spice_server, qxl->core);
 	qxl_add_spice_display_interface (qxl);
+	spiceqxl_inputs_set_screen (qxl);
 	qxl_add_spice_playback_interface (qxl);
 	spiceqxl_vdagent_init (qxl);
     }
@@ -659,6 +726,8 @@ spiceqxl_screen_init (ScrnInfoPtr pScrn, qxl_screen_t *qxl)
         ErrorF("WARNING: XSPICE requires -noreset; crashes are now likely.\n");
     }
 
+    spiceqxl_display_open_release_event (qxl);
+
     if (! qxl->worker_running)
     {
         xspice_register_handlers();
@@ -791,6 +860,8 @@ qxl_screen_init (SCREEN_INIT_ARGS_DECL)
     
     qxl->close_screen = pScreen->CloseScreen;
     pScreen->CloseScreen = qxl_close_screen;
+
+    RegisterBlockAndWakeupHandlers (qxl_block_handler, qxl_wakeup_handler, qxl);
     
     qxl_cursor_init (pScreen);
     
@@ -820,6 +891,8 @@ qxl_screen_init (SCREEN_INIT_ARGS_DECL)
     
     if (qxl->deferred_fps)
         dfps_start_ticker(qxl);
+    else if (qxl->hybrid_fps)
+        dfps_hybrid_init(qxl);
 
     return TRUE;
     
@@ -844,6 +917,7 @@ qxl_enter_vt (VT_FUNC_ARGS_DECL)
     {
 	qxl_mem_free_all (qxl->mem);
 	qxl_drop_image_cache (qxl);
+	qxl_surface_reset_transform_cache (qxl, FALSE);
     }
     
     if (qxl->surf_mem)
@@ -874,7 +948,10 @@ qxl_leave_vt (VT_FUNC_ARGS_DECL)
     pScrn->EnableDisableFBAccess (XF86_SCRN_ARG (pScrn), FALSE);
 
     if (qxl->deferred_fps <= 0)
+    {
+        dfps_hybrid_leave (qxl);
         qxl->vt_surfaces = qxl_surface_cache_evacuate_all (qxl->surface_cache);
+    }
 
     ioport_write (qxl, QXL_IO_RESET, 0);
     
@@ -976,6 +1053,10 @@ qxl_pre_init_common(ScrnInfoPtr pScrn)
 {
     int           scrnIndex = pScrn->scrnIndex;
     qxl_screen_t *qxl = pScrn->driverPrivate;
+    int           deferred_fps_min;
+#ifdef XSPICE
+    int           release_deadline;
+#endif
 
     if (!qxl_color_setup (pScrn))
 	goto out;
@@ -995,19 +1076,67 @@ qxl_pre_init_common(ScrnInfoPtr pScrn)
         get_bool_option (qxl->options, OPTION_DEBUG_RENDER_FALLBACKS, "QXL_DEBUG_RENDER_FALLBACKS");
     qxl->num_heads =
         get_int_option (qxl->options, OPTION_NUM_HEADS, "QXL_NUM_HEADS");
+    qxl->upload_cmd_cost =
+        get_int_option (qxl->options, OPTION_UPLOAD_COMMAND_COST, "QXL_UPLOAD_COMMAND_COST");
+    qxl->upload_byte_cost =
+        get_int_option (qxl->options, OPTION_UPLOAD_BYTE_COST, "QXL_UPLOAD_BYTE_COST");
+    qxl->debug_upload_plans =
+        get_bool_option (qxl->options, OPTION_DEBUG_UPLOAD_PLANS, "QXL_DEBUG_UPLOAD_PLANS");
+    if (qxl->upload_cmd_cost < 0)
+        qxl->upload_cmd_cost = 0;
+    if (qxl->upload_byte_cost < 0)
+        qxl->upload_byte_cost = 0;
+    qxl->pixmap_promote_score =
+        get_int_option (qxl->options, OPTION_PIXMAP_PROMOTE_SCORE, "QXL_PIXMAP_PROMOTE_SCORE");
+    qxl->pixmap_demote_score =
+        get_int_option (qxl->options, OPTION_PIXMAP_DEMOTE_SCORE, "QXL_PIXMAP_DEMOTE_SCORE");
+    if (qxl->pixmap_promote_score < 0)
+        qxl->pixmap_promote_score = 0;
+    if (qxl->pixmap_demote_score < 0)
+        qxl->pixmap_demote_score = 0;
 
     qxl->deferred_fps = get_int_option(qxl->options, OPTION_SPICE_DEFERRED_FPS, "XSPICE_DEFERRED_FPS");
     if (qxl->deferred_fps > 0)
-        xf86DrvMsg(scrnIndex, X_INFO, "Deferred FPS: %d\n", qxl->deferred_fps);
+    {
+        deferred_fps_min = get_int_option(qxl->options, OPTION_SPICE_DEFERRED_FPS_MIN,
+                                          "XSPICE_DEFERRED_FPS_MIN");
+        if (deferred_fps_min <= 0)
+            deferred_fps_min = qxl->deferred_fps / 4;
+        if (deferred_fps_min > (int)qxl->deferred_fps)
+            deferred_fps_min = qxl->deferred_fps;
+        qxl->deferred_fps_min = deferred_fps_min > 0 ? deferred_fps_min : 1;
+        xf86DrvMsg(scrnIndex, X_INFO, "Deferred FPS: %d (min %d)\n",
+                   qxl->deferred_fps, qxl->deferred_fps_min);
+    }
     else
+    {
         xf86DrvMsg(scrnIndex, X_INFO, "Deferred Frames: Disabled\n");
 
+        qxl->hybrid_fps = get_int_option(qxl->options, OPTION_SPICE_HYBRID_FPS, "XSPICE_HYBRID_FPS");
+        if (qxl->hybrid_fps > 0)
+            xf86DrvMsg(scrnIndex, X_INFO, "Hybrid FPS: %d\n", qxl->hybrid_fps);
+    }
+
+#ifdef XSPICE
+    release_deadline = get_int_option(qxl->options, OPTION_SPICE_RELEASE_DEADLINE,
+                                      "XSPICE_RELEASE_DEADLINE");
+    qxl->release_deadline = release_deadline > 0 ? release_deadline : 1;
+    xf86DrvMsg(scrnIndex, X_INFO, "Release deadline: %d ms\n", qxl->release_deadline);
+#endif
+
     xf86DrvMsg (scrnIndex, X_INFO, "Offscreen Surfaces: %s\n",
                 qxl->enable_surfaces ? "Enabled" : "Disabled");
     xf86DrvMsg (scrnIndex, X_INFO, "Image Cache: %s\n",
                 qxl->enable_image_cache ? "Enabled" : "Disabled");
     xf86DrvMsg (scrnIndex, X_INFO, "Fallback Cache: %s\n",
                 qxl->enable_fallback_cache ? "Enabled" : "Disabled");
+    xf86DrvMsg (scrnIndex, X_INFO, "Upload cost: %d per command, %d per byte\n",
+                qxl->upload_cmd_cost, qxl->upload_byte_cost);
+    if (qxl->pixmap_promote_score)
+        xf86DrvMsg (scrnIndex, X_INFO, "Pixmap migration: promote at %d, demote at -%d\n",
+                    qxl->pixmap_promote_score, qxl->pixmap_demote_score);
+    else
+        xf86DrvMsg (scrnIndex, X_INFO, "Pixmap migration: Disabled\n");
 
     return TRUE;
 out:
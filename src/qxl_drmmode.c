@@ -839,6 +839,7 @@ drmmode_xf86crtc_resize (ScrnInfoPtr scrn, int width, int height)
 								    width,
 								    height,
 								    NULL, pitch);
+		REGION_EMPTY (NULL, &qxl->primary->host_valid);
 	}
 		
 	/* fixup the surfaces */
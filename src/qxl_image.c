@@ -53,7 +53,7 @@ static unsigned int
 hash_and_copy (const uint8_t *src, int src_stride,
 	       uint8_t *dest, int dest_stride,
 	       int bytes_per_pixel, int width, int height,
-	       uint32_t hash)
+	       Bool do_hash, uint32_t hash)
 {
     int i;
   
@@ -66,7 +66,8 @@ hash_and_copy (const uint8_t *src, int src_stride,
 	if (dest)
 	    memcpy (dest_line, src_line, n_bytes);
 
-	MurmurHash3_x86_32 (src_line, n_bytes, hash, &hash);
+	if (do_hash)
+	    MurmurHash3_x86_32 (src_line, n_bytes, hash, &hash);
     }
 
     return hash;
@@ -128,12 +129,31 @@ remove_image_info (image_info_t *info)
     free (info);
 }
 
-struct qxl_bo *
-qxl_image_create (qxl_screen_t *qxl, const uint8_t *data,
-		  int x, int y, int width, int height,
-		  int stride, int Bpp, Bool fallback)
+/* The cache id of an image; the same as qxl_image_create computes. */
+uint32_t
+qxl_image_hash (const uint8_t *data, int x, int y, int width, int height,
+		int stride, int Bpp)
+{
+    return hash_and_copy (data + y * stride + x * Bpp, stride, NULL, 0,
+			  Bpp, width, height, TRUE, 0);
+}
+
+/* Lines of image data that go into one chunk */
+static int
+chunk_lines (int dest_stride)
+{
+    return MAX (512 * 512, dest_stride) / dest_stride;
+}
+
+/* Copies @data into the new image unless @reserve is given; then the
+ * chunks are recorded there and left mapped for qxl_image_fill_reserved,
+ * and @hash is the cache id of the pixels that will go in. */
+static struct qxl_bo *
+image_create (qxl_screen_t *qxl, const uint8_t *data,
+	      int x, int y, int width, int height,
+	      int stride, int Bpp, Bool fallback,
+	      struct qxl_image_reservation *reserve, uint32_t hash)
 {
-	uint32_t hash;
 	image_info_t *info;
 	struct QXLImage *image;
 	struct qxl_bo *head_bo, *tail_bo;
@@ -141,7 +161,8 @@ qxl_image_create (qxl_screen_t *qxl, const uint8_t *data,
 	int dest_stride = (width * Bpp + 3) & (~3);
 	int h;
 
-	data += y * stride + x * Bpp;
+	if (data)
+	    data += y * stride + x * Bpp;
 
 #if 0
 	ErrorF ("Must create new image of size %d %d\n", width, height);
@@ -153,19 +174,30 @@ qxl_image_create (qxl_screen_t *qxl, const uint8_t *data,
 
 	head_bo = tail_bo = NULL;
 
-	hash = 0;
+	if (!reserve)
+	    hash = 0;
 	h = height;
 	while (h)
 	{
-	    int chunk_size = MAX (512 * 512, dest_stride);
-	    int n_lines = MIN ((chunk_size / dest_stride), h);
+	    int n_lines = MIN (chunk_lines (dest_stride), h);
 	    struct qxl_bo *bo = qxl->bo_funcs->bo_alloc (qxl, sizeof (QXLDataChunk) + n_lines * dest_stride, "image data");
 
 	    QXLDataChunk *chunk = qxl->bo_funcs->bo_map(bo);
 	    chunk->data_size = n_lines * dest_stride;
-	    hash = hash_and_copy (data, stride,
-				  chunk->data, dest_stride,
-				  Bpp, width, n_lines, hash);
+	    if (reserve)
+	    {
+		struct qxl_image_chunk_map *map = &reserve->chunks[reserve->n_chunks++];
+
+		map->bo = bo;
+		map->data = chunk->data;
+		map->n_lines = n_lines;
+	    }
+	    else
+	    {
+		hash = hash_and_copy (data, stride,
+				      chunk->data, dest_stride,
+				      Bpp, width, n_lines, TRUE, hash);
+	    }
 	    
 	    if (tail_bo)
 	    {
@@ -185,10 +217,13 @@ qxl_image_create (qxl_screen_t *qxl, const uint8_t *data,
 		chunk->prev_chunk = 0;
 	    }
 
-	    qxl->bo_funcs->bo_unmap(bo);
+	    /* a reserved chunk is kept alive by the image */
+	    if (!reserve)
+		qxl->bo_funcs->bo_unmap(bo);
 	    if (bo != head_bo)
 		qxl->bo_funcs->bo_decref(qxl, bo);
-	    data += n_lines * stride;
+	    if (data)
+		data += n_lines * stride;
 	    h -= n_lines;
 	}
 
@@ -251,6 +286,76 @@ qxl_image_create (qxl_screen_t *qxl, const uint8_t *data,
 	return image_bo;
 }
 
+struct qxl_bo *
+qxl_image_create (qxl_screen_t *qxl, const uint8_t *data,
+		  int x, int y, int width, int height,
+		  int stride, int Bpp, Bool fallback)
+{
+    return image_create (qxl, data, x, y, width, height, stride, Bpp,
+			 fallback, NULL, 0);
+}
+
+/* Allocates a fallback image whose pixels are copied in later by
+ * qxl_image_fill_reserved, which is safe to call from another thread.
+ * @hash is their qxl_image_hash. The image can only be used once
+ * qxl_image_finish_reserved has handed it out. */
+Bool
+qxl_image_reserve (qxl_screen_t *qxl, int width, int height, int Bpp,
+		   uint32_t hash, struct qxl_image_reservation *reserve)
+{
+    int dest_stride = (width * Bpp + 3) & (~3);
+    int per_chunk = chunk_lines (dest_stride);
+
+    reserve->width = width;
+    reserve->height = height;
+    reserve->stride = dest_stride;
+    reserve->n_chunks = 0;
+    reserve->chunks = malloc (((height + per_chunk - 1) / per_chunk) *
+			      sizeof (struct qxl_image_chunk_map));
+    if (!reserve->chunks)
+	return FALSE;
+
+    reserve->image_bo = image_create (qxl, NULL, 0, 0, width, height, 0, Bpp,
+				      TRUE, reserve, hash);
+    return TRUE;
+}
+
+/* Copies the pixels at @x, @y of @data into a reserved image. Only
+ * touches the mapped chunks, so it may run on any thread. */
+void
+qxl_image_fill_reserved (const struct qxl_image_reservation *reserve,
+			 const uint8_t *data, int x, int y,
+			 int stride, int Bpp)
+{
+    int i;
+
+    data += y * stride + x * Bpp;
+    for (i = 0; i < reserve->n_chunks; i++)
+    {
+	const struct qxl_image_chunk_map *map = &reserve->chunks[i];
+
+	hash_and_copy (data, stride, map->data, reserve->stride,
+		       Bpp, reserve->width, map->n_lines, FALSE, 0);
+	data += map->n_lines * stride;
+    }
+}
+
+/* Unmaps a reserved image and returns it; the caller owns the
+ * reference. */
+struct qxl_bo *
+qxl_image_finish_reserved (qxl_screen_t *qxl,
+			   struct qxl_image_reservation *reserve)
+{
+    int i;
+
+    for (i = 0; i < reserve->n_chunks; i++)
+	qxl->bo_funcs->bo_unmap (reserve->chunks[i].bo);
+    free (reserve->chunks);
+    reserve->chunks = NULL;
+    reserve->n_chunks = 0;
+    return reserve->image_bo;
+}
+
 void
 qxl_image_destroy (qxl_screen_t *qxl,
 		   struct qxl_bo *image_bo)
@@ -69,6 +69,8 @@ qxl_wait_for_display_interrupt (qxl_screen_t *qxl)
 void
 qxl_update_area (qxl_screen_t *qxl)
 {
+    qxl_flush_pending (qxl);
+
 #ifndef XSPICE
     if (qxl->pci->revision >= 3)
     {
@@ -124,6 +126,8 @@ qxl_io_create_primary (qxl_screen_t *qxl)
 void
 qxl_io_destroy_primary (qxl_screen_t *qxl)
 {
+    qxl_flush_pending (qxl);
+
 #ifndef XSPICE
     if (qxl->pci->revision >= 3)
     {
@@ -149,6 +153,8 @@ qxl_io_notify_oom (qxl_screen_t *qxl)
 void
 qxl_io_flush_surfaces (qxl_screen_t *qxl)
 {
+    qxl_flush_pending (qxl);
+
     // FIXME: write individual update_area for revision < V10
 #ifndef XSPICE
     ioport_write (qxl, QXL_IO_FLUSH_SURFACES_ASYNC, 0);
@@ -192,6 +198,8 @@ qxl_io_monitors_config_async (qxl_screen_t *qxl)
 void
 qxl_io_destroy_all_surfaces (qxl_screen_t *qxl)
 {
+    qxl_flush_pending (qxl);
+
 #ifndef XSPICE
     if (qxl->pci->revision >= 3)
     {
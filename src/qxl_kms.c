@@ -95,6 +95,8 @@ qxl_close_screen_kms (CLOSE_SCREEN_ARGS_DECL)
     Bool result;
 
     qxl_drmmode_uevent_fini(pScrn, &qxl->drmmode);
+    /* the kernel keeps the objects alive until they are released */
+    qxl_surface_reset_transform_cache (qxl, TRUE);
     pScreen->CloseScreen = qxl->close_screen;
 
     result = pScreen->CloseScreen (CLOSE_SCREEN_ARGS);
@@ -661,9 +663,11 @@ qxl_kms_surface_create(qxl_screen_t *qxl,
     surface->dev_image = pixman_image_create_bits (
 		   pformat, width, height, dev_addr, - stride);
 
-    surface->host_image = pixman_image_create_bits (
-	pformat, width, height, NULL, -1);
+    /* the host copy is allocated on the first fallback */
+    surface->host_image = NULL;
     REGION_INIT (NULL, &(surface->access_region), (BoxPtr)NULL, 0);
+    REGION_INIT (NULL, &(surface->access_rw_region), (BoxPtr)NULL, 0);
+    REGION_INIT (NULL, &(surface->host_valid), (BoxPtr)NULL, 0);
     qxl->bo_funcs->bo_unmap(surface->bo);
     surface->access_type = UXA_ACCESS_RO;
     surface->bpp = bpp;
@@ -677,8 +681,10 @@ static void qxl_kms_surface_destroy(qxl_surface_t *surf)
 
     if (surf->dev_image)
 	pixman_image_unref (surf->dev_image);
-    if (surf->host_image)
-	pixman_image_unref (surf->host_image);
+    qxl_surface_free_host_image (surf);
+    REGION_UNINIT (NULL, &surf->access_region);
+    REGION_UNINIT (NULL, &surf->access_rw_region);
+    REGION_UNINIT (NULL, &surf->host_valid);
 
     if (surf->image_bo)
       qxl->bo_funcs->bo_decref(qxl, surf->image_bo);
@@ -26,6 +26,8 @@
 
 #include <stdarg.h>
 #include <errno.h>
+#include <limits.h>
+#include <string.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -50,6 +52,7 @@ struct qxl_mem
     mspace	space;
     void *	base;
     unsigned long n_bytes;
+    unsigned long n_used;
 #ifdef DEBUG_QXL_MEM
     size_t used_initial;
     int unverifiable;
@@ -133,6 +136,21 @@ qxl_mem_dump_stats   (struct qxl_mem         *mem,
     mspace_malloc_stats (mem->space);
 }
 
+/* Rough share of the space that is still free, in percent. Allocator
+ * overhead is not counted, and the Xspice worker reads this without
+ * locking, so only use it as a hint.
+ */
+int
+qxl_mem_free_percent (struct qxl_mem         *mem)
+{
+    unsigned long used = mem->n_used;
+
+    if (used >= mem->n_bytes)
+	return 0;
+
+    return (mem->n_bytes - used) * 100 / mem->n_bytes;
+}
+
 static void *
 qxl_alloc            (struct qxl_mem         *mem,
 		      unsigned long           n_bytes,
@@ -140,6 +158,9 @@ qxl_alloc            (struct qxl_mem         *mem,
 {
     void *addr = mspace_malloc (mem->space, n_bytes);
 
+    if (addr)
+	mem->n_used += n_bytes;
+
 #ifdef DEBUG_QXL_MEM
     VALGRIND_MALLOCLIKE_BLOCK(addr, n_bytes, 0, 0);
 #ifdef DEBUG_QXL_MEM_VERBOSE
@@ -152,12 +173,14 @@ qxl_alloc            (struct qxl_mem         *mem,
 static void
 qxl_free             (struct qxl_mem         *mem,
 		      void                   *d,
+		      unsigned long           n_bytes,
 		      const char *            name)
 {
 #if 0
     ErrorF ("%p <= free %s\n", d, name);
 #endif
     mspace_free (mem->space, d);
+    mem->n_used -= n_bytes;
 #ifdef DEBUG_QXL_MEM
 #ifdef DEBUG_QXL_MEM_VERBOSE
     fprintf(stderr, "free  %p %s\n", d, name);
@@ -181,6 +204,7 @@ qxl_mem_free_all     (struct qxl_mem         *mem)
     }
 #endif
     mem->space = create_mspace_with_base (mem->base, mem->n_bytes, 0, NULL);
+    mem->n_used = 0;
 }
 
 static uint8_t
@@ -290,6 +314,12 @@ qxl_garbage_collect_internal (qxl_screen_t *qxl, uint64_t id)
     else
 	is_drawable = TRUE;
 
+    if (is_drawable && drawable->clip.type == SPICE_CLIP_TYPE_RECTS)
+    {
+	to_free = qxl_ums_lookup_phy_addr(qxl, drawable->clip.data);
+	qxl->bo_funcs->bo_decref (qxl, to_free);
+    }
+
     if (is_cursor && cmd->type == QXL_CURSOR_SET)
     {
 	to_free = qxl_ums_lookup_phy_addr(qxl, cmd->u.set.shape);
@@ -356,13 +386,17 @@ qxl_garbage_collect_internal (qxl_screen_t *qxl, uint64_t id)
     return id;
 }
 
+/* Collect released resources until at least @budget of them have
+ * been freed. A release ring entry is always processed completely,
+ * so the budget may be exceeded by the length of the last chain.
+ */
 int
-qxl_garbage_collect (qxl_screen_t *qxl)
+qxl_garbage_collect_bounded (qxl_screen_t *qxl, int budget)
 {
     uint64_t id;
     int      i = 0;
 
-    while (qxl_ring_pop (qxl->release_ring, &id))
+    while (i < budget && qxl_ring_pop (qxl->release_ring, &id))
     {
 	while (id)
 	{
@@ -375,6 +409,13 @@ qxl_garbage_collect (qxl_screen_t *qxl)
     return i;
 }
 
+int
+qxl_garbage_collect (qxl_screen_t *qxl)
+{
+    return qxl_garbage_collect_bounded (qxl, INT_MAX);
+}
+
+#ifndef XSPICE
 static void
 qxl_usleep (int useconds)
 {
@@ -387,10 +428,13 @@ qxl_usleep (int useconds)
     while (nanosleep (&t, &t) == -1 && errno == EINTR)
 	;
 }
+#endif
 
 int
 qxl_handle_oom (qxl_screen_t *qxl)
 {
+    /* held back drawables can only be released once the device saw them */
+    qxl_flush_pending (qxl);
     qxl_io_notify_oom (qxl);
 
 #if 0
@@ -398,8 +442,11 @@ qxl_handle_oom (qxl_screen_t *qxl)
     qxl_usleep (10000);
 #endif
 
+#ifndef XSPICE
     if (!(qxl_garbage_collect (qxl)))
 	qxl_usleep (10000);
+#endif
+    /* Xspice has already waited for the worker in qxl_io_notify_oom */
 
     return qxl_garbage_collect (qxl);
 }
@@ -587,17 +634,219 @@ static void qxl_bo_decref(qxl_screen_t *qxl, struct qxl_bo *_bo)
     else
 	mptr = qxl->mem;
 
-    qxl_free(mptr, bo->internal_virt_addr, bo->name);
+    qxl_free(mptr, bo->internal_virt_addr, bo->size, bo->name);
     if (bo->type != QXL_BO_SURF)
 	xorg_list_del(&bo->bos);
 out_free:
     free(bo);
 }
 
-static void qxl_bo_write_command(qxl_screen_t *qxl, uint32_t cmd_type, struct qxl_bo *bo)
+static void qxl_push_command(qxl_screen_t *qxl, uint32_t cmd_type, struct qxl_bo *bo)
 {
     struct QXLCommand cmd;
 
+    cmd.type = cmd_type;
+    qxl_bo_output_cmd_reloc(qxl, &cmd, bo);
+
+    if (cmd_type == QXL_CMD_CURSOR)
+	qxl_ring_push (qxl->cursor_ring, &cmd);
+    else
+	qxl_ring_push (qxl->command_ring, &cmd);
+
+    qxl_bo_decref(qxl, bo);
+}
+
+/*
+ * Pending drawables
+ *
+ * Drawables are queued instead of pushed, and sent in order from the
+ * block handler, or earlier when the queue is full, when any other
+ * command is written, or before the device is asked to render or
+ * release anything. When an opaque drawable arrives, queued drawables
+ * on the same surface whose bounding box it paints over are released
+ * unsent. Most drawables are clipped to the operation's region; when
+ * that is a single rectangle, the part of the bounding box inside it
+ * counts as painted over. Drawables that a later one reads from, through
+ * a copy or composite source or COPY_BITS, are pinned and always sent.
+ * Partly covered drawables are sent as they are.
+ */
+
+/* Narrows @area to the clip at @clip if that is a single rectangle. */
+static Bool
+clip_single_rect (qxl_screen_t *qxl, uint64_t clip, struct QXLRect *area)
+{
+    struct qxl_bo *bo = qxl_ums_lookup_phy_addr (qxl, clip);
+    QXLClipRects *rects;
+    Bool single;
+
+    if (!bo)
+	return FALSE;
+
+    rects = qxl_bo_map (bo);
+    single = rects->num_rects == 1 && !rects->chunk.next_chunk;
+    if (single)
+    {
+	const QXLRect *r = (const QXLRect *)rects->chunk.data;
+
+	if (r->left > area->left)
+	    area->left = r->left;
+	if (r->top > area->top)
+	    area->top = r->top;
+	if (r->right < area->right)
+	    area->right = r->right;
+	if (r->bottom < area->bottom)
+	    area->bottom = r->bottom;
+    }
+    qxl_bo_unmap (bo);
+
+    return single && area->left < area->right && area->top < area->bottom;
+}
+
+/* If @drawable hides what is under it, stores the area it paints over
+ * in @area. */
+static Bool
+drawable_occludes (qxl_screen_t *qxl, struct QXLDrawable *drawable,
+		   struct QXLRect *area)
+{
+    Bool opaque;
+
+    if (drawable->effect != QXL_EFFECT_OPAQUE)
+	return FALSE;
+
+    switch (drawable->type)
+    {
+    case QXL_DRAW_FILL:
+	opaque = !drawable->u.fill.mask.bitmap;
+	break;
+    case QXL_DRAW_COPY:
+	opaque = !drawable->u.copy.mask.bitmap;
+	break;
+    case QXL_COPY_BITS:
+	opaque = TRUE;
+	break;
+    default:
+	opaque = FALSE;
+	break;
+    }
+    if (!opaque)
+	return FALSE;
+
+    *area = drawable->bbox;
+    switch (drawable->clip.type)
+    {
+    case SPICE_CLIP_TYPE_NONE:
+	return TRUE;
+    case SPICE_CLIP_TYPE_RECTS:
+	return clip_single_rect (qxl, drawable->clip.data, area);
+    default:
+	return FALSE;
+    }
+}
+
+static void
+pin_pending (qxl_screen_t *qxl, uint32_t surface_id)
+{
+    int i;
+
+    for (i = 0; i < qxl->n_pending; i++)
+    {
+	if (qxl->pending[i].surface_id == surface_id)
+	    qxl->pending[i].pinned = TRUE;
+    }
+}
+
+static Bool
+rect_contains (const struct QXLRect *outer, const struct QXLRect *inner)
+{
+    return outer->left <= inner->left && outer->top <= inner->top &&
+	outer->right >= inner->right && outer->bottom >= inner->bottom;
+}
+
+static void
+queue_drawable (qxl_screen_t *qxl, struct qxl_bo *bo)
+{
+    struct QXLDrawable *drawable;
+    struct qxl_bo *culled[QXL_PENDING_MAX];
+    struct qxl_pending *p;
+    struct QXLRect area;
+    int n_culled = 0;
+    int i, n, last;
+
+    if (qxl->n_pending == QXL_PENDING_MAX)
+	qxl_flush_pending (qxl);
+
+    drawable = qxl_bo_map (bo);
+
+    /* A composite lists its destination last among the surfaces it
+     * depends on; it only reads that one at the pixels it writes,
+     * which does not keep what is under it from being painted over. */
+    for (last = 2; last >= 0 && drawable->surfaces_dest[last] == -1; last--)
+	;
+    for (i = 0; i <= last; i++)
+    {
+	if (drawable->surfaces_dest[i] == -1)
+	    continue;
+	if (drawable->type == QXL_DRAW_COMPOSITE && i == last &&
+	    drawable->surfaces_dest[i] == drawable->surface_id)
+	    continue;
+	pin_pending (qxl, drawable->surfaces_dest[i]);
+    }
+    if (drawable->type == QXL_COPY_BITS)
+	pin_pending (qxl, drawable->surface_id);
+
+    if (drawable_occludes (qxl, drawable, &area))
+    {
+	for (i = n = 0; i < qxl->n_pending; i++)
+	{
+	    p = &qxl->pending[i];
+	    if (!p->pinned && p->surface_id == drawable->surface_id &&
+		rect_contains (&area, &p->bbox))
+	    {
+		culled[n_culled++] = p->bo;
+		continue;
+	    }
+	    qxl->pending[n++] = *p;
+	}
+	qxl->n_pending = n;
+    }
+
+    p = &qxl->pending[qxl->n_pending++];
+    p->bo = bo;
+    p->surface_id = drawable->surface_id;
+    p->bbox = drawable->bbox;
+    p->pinned = FALSE;
+    qxl_bo_unmap (bo);
+
+    /* last, as releasing can write surface commands, which flush */
+    for (i = 0; i < n_culled; i++)
+	qxl_garbage_collect_internal (qxl, pointer_to_u64 (culled[i]));
+}
+
+void
+qxl_flush_pending (qxl_screen_t *qxl)
+{
+    struct qxl_pending pending[QXL_PENDING_MAX];
+    int i, n = qxl->n_pending;
+
+    if (!n)
+	return;
+
+    memcpy (pending, qxl->pending, n * sizeof (struct qxl_pending));
+    qxl->n_pending = 0;
+
+    for (i = 0; i < n; i++)
+    {
+	/* see qxl_bo_write_command */
+	if (qxl->pScrn->vtSema)
+	    qxl_push_command (qxl, QXL_CMD_DRAW, pending[i].bo);
+	else
+	    qxl_garbage_collect_internal (qxl, pointer_to_u64 (pending[i].bo));
+    }
+}
+
+static void qxl_bo_write_command(qxl_screen_t *qxl, uint32_t cmd_type, struct qxl_bo *bo)
+{
+
     /* When someone runs "init 3", the device will be 
      * switched into VGA mode and there is nothing we
      * can do about it. We get no notification.
@@ -614,15 +863,17 @@ static void qxl_bo_write_command(qxl_screen_t *qxl, uint32_t cmd_type, struct qx
     if (!qxl->pScrn->vtSema && cmd_type != QXL_CMD_SURFACE)
 	return;
 
-    cmd.type = cmd_type;
-    qxl_bo_output_cmd_reloc(qxl, &cmd, bo);
+    if (cmd_type == QXL_CMD_DRAW)
+    {
+	queue_drawable (qxl, bo);
+	return;
+    }
 
-    if (cmd_type == QXL_CMD_CURSOR)
-	qxl_ring_push (qxl->cursor_ring, &cmd);
-    else
-	qxl_ring_push (qxl->command_ring, &cmd);
+    /* cursor commands have a ring of their own */
+    if (cmd_type != QXL_CMD_CURSOR)
+	qxl_flush_pending (qxl);
 
-    qxl_bo_decref(qxl, bo);
+    qxl_push_command (qxl, cmd_type, bo);
 }
 
 static void qxl_bo_update_area(qxl_surface_t *surf, int x1, int y1, int x2, int y2)
@@ -154,3 +154,11 @@ qxl_ring_prod (struct qxl_ring *ring)
 {
     return ring->ring->header.prod;
 }
+
+int
+qxl_ring_used_percent (struct qxl_ring *ring)
+{
+    volatile struct qxl_ring_header *header = &(ring->ring->header);
+
+    return (header->prod - header->cons) * 100 / ring->n_elements;
+}
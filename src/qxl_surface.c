@@ -24,8 +24,12 @@
 #include "config.h"
 #endif
 
+#include <stdint.h>
+#include <string.h>
+
 #include "qxl.h"
 #include "qxl_surface.h"/* send anything pending to the other side */
+#include "dfps.h"
 
 
 enum ROPDescriptor
@@ -43,15 +47,39 @@ enum ROPDescriptor
     ROPD_INVERS_RES = (1 <<10),
 };
 
+/* The device is about to change inside @rect, so the host copy can no
+ * longer be trusted there. */
+static void
+invalidate_host (qxl_surface_t *surf, const struct QXLRect *rect)
+{
+    BoxRec box;
+    RegionRec r;
+
+    if (!REGION_NOTEMPTY (NULL, &surf->host_valid))
+	return;
+
+    box.x1 = rect->left;
+    box.y1 = rect->top;
+    box.x2 = rect->right;
+    box.y2 = rect->bottom;
+
+    REGION_INIT (NULL, &r, &box, 1);
+    REGION_SUBTRACT (NULL, &surf->host_valid, &surf->host_valid, &r);
+    REGION_UNINIT (NULL, &r);
+}
+
+/* With @clip, only the @n_clip boxes inside @rect are drawn. */
 static struct qxl_bo *
 make_drawable (qxl_screen_t *qxl, qxl_surface_t *surf, uint8_t type,
-	       const struct QXLRect *rect
-	       /* , pRegion clip */)
+	       const struct QXLRect *rect,
+	       const BoxRec *clip, int n_clip)
 {
     struct QXLDrawable *drawable;
     struct qxl_bo *draw_bo;
     int i;
    
+    invalidate_host (surf, rect);
+
     draw_bo = qxl->bo_funcs->cmd_alloc (qxl, sizeof *drawable, "drawable command");
     assert(draw_bo);
     drawable = qxl->bo_funcs->bo_map(draw_bo);
@@ -69,8 +97,39 @@ make_drawable (qxl_screen_t *qxl, qxl_surface_t *surf, uint8_t type,
     drawable->self_bitmap_area.left = 0;
     drawable->self_bitmap_area.bottom = 0;
     drawable->self_bitmap_area.right = 0;
-    /* FIXME: add clipping */
-    drawable->clip.type = SPICE_CLIP_TYPE_NONE;
+    if (clip)
+    {
+	struct qxl_bo *clip_bo;
+	QXLClipRects *rects;
+	QXLRect *r;
+
+	clip_bo = qxl->bo_funcs->bo_alloc (
+	    qxl, sizeof (QXLClipRects) + n_clip * sizeof (QXLRect), "clip rects");
+	rects = qxl->bo_funcs->bo_map(clip_bo);
+	rects->num_rects = n_clip;
+	rects->chunk.data_size = n_clip * sizeof (QXLRect);
+	rects->chunk.prev_chunk = 0;
+	rects->chunk.next_chunk = 0;
+	r = (QXLRect *)rects->chunk.data;
+	for (i = 0; i < n_clip; ++i)
+	{
+	    r[i].left = clip[i].x1;
+	    r[i].top = clip[i].y1;
+	    r[i].right = clip[i].x2;
+	    r[i].bottom = clip[i].y2;
+	}
+	qxl->bo_funcs->bo_unmap(clip_bo);
+
+	drawable->clip.type = SPICE_CLIP_TYPE_RECTS;
+	qxl->bo_funcs->bo_output_bo_reloc(qxl, offsetof(struct QXLDrawable, clip.data),
+					  draw_bo, clip_bo);
+	qxl->bo_funcs->bo_decref(qxl, clip_bo);
+    }
+    else
+    {
+	drawable->clip.type = SPICE_CLIP_TYPE_NONE;
+	drawable->clip.data = 0;
+    }
     
     /*
      * surfaces_dest[i] should apparently be filled out with the
@@ -99,12 +158,13 @@ push_drawable (qxl_screen_t *qxl, struct qxl_bo *drawable_bo)
 
 static void
 submit_fill (qxl_screen_t *qxl, qxl_surface_t *surf,
-	     const struct QXLRect *rect, uint32_t color)
+	     const struct QXLRect *rect, const BoxRec *clip, int n_clip,
+	     uint32_t color)
 {
     struct qxl_bo *drawable_bo;
     struct QXLDrawable *drawable;
     
-    drawable_bo = make_drawable (qxl, surf, QXL_DRAW_FILL, rect);
+    drawable_bo = make_drawable (qxl, surf, QXL_DRAW_FILL, rect, clip, n_clip);
     
     drawable = qxl->bo_funcs->bo_map(drawable_bo);
     drawable->u.fill.brush.type = SPICE_BRUSH_TYPE_SOLID;
@@ -120,12 +180,6 @@ submit_fill (qxl_screen_t *qxl, qxl_surface_t *surf,
     push_drawable (qxl, drawable_bo);
 }
 
-void
-qxl_surface_flush (qxl_surface_t *surface)
-{
-    ;
-}
-
 /* access */
 static void
 download_box_no_update (qxl_surface_t *surface, int x1, int y1, int x2, int y2)
@@ -145,6 +199,140 @@ qxl_download_box (qxl_surface_t *surface, int x1, int y1, int x2, int y2)
     download_box_no_update(surface, x1, y1, x2, y2);
 }
 
+static void
+mark_host_valid (qxl_surface_t *surface, int x1, int y1, int x2, int y2)
+{
+    BoxRec box;
+    RegionRec r;
+
+    box.x1 = x1;
+    box.y1 = y1;
+    box.x2 = x2;
+    box.y2 = y2;
+
+    REGION_INIT (NULL, &r, &box, 1);
+    REGION_UNION (NULL, &surface->host_valid, &surface->host_valid, &r);
+    REGION_UNINIT (NULL, &r);
+}
+
+/*
+ * Host images
+ *
+ * A surface only gets a host copy when a software fallback touches it,
+ * and loses it again once fallbacks have left it alone for
+ * HOST_IMAGE_IDLE_MS. fb needs the whole pixmap in one linear buffer,
+ * so the copy is never partial. The primary is allocated along with
+ * its surface and kept.
+ */
+#define HOST_IMAGE_IDLE_MS	10000
+#define HOST_IMAGE_SWEEP_MS	1000
+
+static void
+host_image_unlink (qxl_surface_t *surface)
+{
+    qxl_screen_t *qxl = surface->qxl;
+
+    if (surface->host_prev)
+	surface->host_prev->host_next = surface->host_next;
+    else if (qxl->host_images == surface)
+	qxl->host_images = surface->host_next;
+    if (surface->host_next)
+	surface->host_next->host_prev = surface->host_prev;
+
+    surface->host_next = NULL;
+    surface->host_prev = NULL;
+}
+
+static void
+host_image_touch (qxl_surface_t *surface)
+{
+    qxl_screen_t *qxl = surface->qxl;
+
+    if (surface == qxl->primary)
+	return;
+
+    host_image_unlink (surface);
+
+    surface->host_next = qxl->host_images;
+    if (qxl->host_images)
+	qxl->host_images->host_prev = surface;
+    qxl->host_images = surface;
+
+    surface->host_used = GetTimeInMillis ();
+}
+
+Bool
+qxl_surface_alloc_host_image (qxl_surface_t *surface)
+{
+    if (!surface->host_image)
+    {
+	surface->host_image = pixman_image_create_bits (
+	    pixman_image_get_format (surface->dev_image),
+	    pixman_image_get_width (surface->dev_image),
+	    pixman_image_get_height (surface->dev_image), NULL, -1);
+
+	if (!surface->host_image)
+	    return FALSE;
+
+	REGION_EMPTY (NULL, &surface->host_valid);
+    }
+
+    host_image_touch (surface);
+    return TRUE;
+}
+
+void
+qxl_surface_free_host_image (qxl_surface_t *surface)
+{
+    host_image_unlink (surface);
+
+    if (surface->host_image)
+	pixman_image_unref (surface->host_image);
+    surface->host_image = NULL;
+
+    REGION_EMPTY (NULL, &surface->host_valid);
+}
+
+/* Hand @image, whose reference is taken over, to @surface as its host
+ * copy, e.g. when the contents of an evacuated surface come back. */
+void
+qxl_surface_set_host_image (qxl_surface_t *surface, pixman_image_t *image)
+{
+    qxl_surface_free_host_image (surface);
+
+    surface->host_image = image;
+    host_image_touch (surface);
+}
+
+void
+qxl_surface_expire_host_images (qxl_screen_t *qxl)
+{
+    CARD32 now = GetTimeInMillis ();
+    qxl_surface_t *s, *next;
+
+    if ((CARD32)(now - qxl->host_images_swept) < HOST_IMAGE_SWEEP_MS)
+	return;
+    qxl->host_images_swept = now;
+
+    /* the list is in access order, so everything after the first
+     * expired entry has expired too */
+    for (s = qxl->host_images; s; s = s->host_next)
+    {
+	if ((CARD32)(now - s->host_used) >= HOST_IMAGE_IDLE_MS)
+	    break;
+    }
+
+    for (; s; s = next)
+    {
+	next = s->host_next;
+
+	if (REGION_NOTEMPTY (NULL, &s->access_region))
+	    continue;
+
+	qxl_surface_free_host_image (s);
+    }
+}
+
 Bool
 qxl_surface_prepare_access (qxl_surface_t  *surface,
 			    PixmapPtr       pixmap,
@@ -160,22 +348,46 @@ qxl_surface_prepare_access (qxl_surface_t  *surface,
     if (!pScrn->vtSema)
         return FALSE;
 
-    REGION_INIT (NULL, &new, (BoxPtr)NULL, 0);
-    REGION_SUBTRACT (NULL, &new, region, &surface->access_region);
+    if (!qxl_surface_alloc_host_image (surface))
+	return FALSE;
+
+    /* batched drawing has to reach the device before the host copy is
+     * read or written */
+    if (surface->qxl->batch.n_boxes)
+	qxl_surface_flush (surface->qxl->batch.dest);
 
     if (access == UXA_ACCESS_RW)
+    {
 	surface->access_type = UXA_ACCESS_RW;
+	REGION_UNION (pScreen, &(surface->access_rw_region),
+		      &(surface->access_rw_region), region);
+    }
+
+    REGION_INIT (NULL, &new, (BoxPtr)NULL, 0);
+    REGION_SUBTRACT (NULL, &new, region, &surface->access_region);
+
+    REGION_UNION (pScreen,
+		  &(surface->access_region),
+		  &(surface->access_region),
+		      &new);
+
+    /* what the device has not drawn on since the last download is
+     * already in the host copy */
+    REGION_SUBTRACT (NULL, &new, &new, &surface->host_valid);
     
-    region = &new;
-    
-    n_boxes = REGION_NUM_RECTS (region);
-    boxes = REGION_RECTS (region);
+    n_boxes = REGION_NUM_RECTS (&new);
+    boxes = REGION_RECTS (&new);
 
-    if (n_boxes < 25)
+    if (dfps_hybrid_owns (surface))
+    {
+	/* the host copy is the reference while updates are deferred */
+    }
+    else if (n_boxes < 25)
     {
 	while (n_boxes--)
 	{
 	    qxl_download_box (surface, boxes->x1, boxes->y1, boxes->x2, boxes->y2);
+	    mark_host_valid (surface, boxes->x1, boxes->y1, boxes->x2, boxes->y2);
 	    
 	    boxes++;
 	}
@@ -185,13 +397,9 @@ qxl_surface_prepare_access (qxl_surface_t  *surface,
 	qxl_download_box (
 	    surface,
 	    new.extents.x1, new.extents.y1, new.extents.x2, new.extents.y2);
+	REGION_UNION (pScreen, &surface->host_valid, &surface->host_valid, &new);
     }
     
-    REGION_UNION (pScreen,
-		  &(surface->access_region),
-		  &(surface->access_region),
-		      region);
-    
     REGION_UNINIT (NULL, &new);
     
     pScreen->ModifyPixmapHeader(
@@ -229,7 +437,7 @@ real_upload_box (qxl_surface_t *surface, int x1, int y1, int x2, int y2)
     rect.top = y1;
     rect.bottom = y2;
     
-    drawable_bo = make_drawable (qxl, surface, QXL_DRAW_COPY, &rect);
+    drawable_bo = make_drawable (qxl, surface, QXL_DRAW_COPY, &rect, NULL, 0);
     drawable = qxl->bo_funcs->bo_map(drawable_bo);
     drawable->u.copy.src_area = rect;
     translate_rect (&drawable->u.copy.src_area);
@@ -253,6 +461,8 @@ real_upload_box (qxl_surface_t *surface, int x1, int y1, int x2, int y2)
     push_drawable (qxl, drawable_bo);
 
     qxl->bo_funcs->bo_decref(qxl, image_bo);
+
+    mark_host_valid (surface, x1, y1, x2, y2);
 }
 
 #define TILE_WIDTH 512
@@ -280,22 +490,140 @@ qxl_upload_box (qxl_surface_t *surface, int x1, int y1, int x2, int y2)
     }
 }
 
+/*
+ * Upload plans
+ *
+ * A set of changed boxes is merged into a few rectangles before upload.
+ * Each rectangle costs upload_cmd_cost for the command plus
+ * upload_byte_cost per byte of pixels it covers; pairs of rectangles are
+ * merged greedily as long as that lowers the total, and regardless of
+ * cost while there are more than COALESCE_MAX_BOXES. When @valid is
+ * given, merged rectangles must stay inside it: the pixels outside are
+ * not known to be up to date and must not be sent.
+ */
+#define COALESCE_MAX_INPUT	QXL_UPLOAD_PLAN_MAX /* boxes considered one by one */
+#define COALESCE_MAX_BOXES	32	/* rectangles in a plan */
+#define COALESCE_WINDOW		8	/* merge partners looked at per box */
+
+static int64_t
+box_cost (qxl_screen_t *qxl, const BoxRec *b, int cpp)
+{
+    int64_t bytes = (int64_t)(b->x2 - b->x1) * (b->y2 - b->y1) * cpp;
+
+    return qxl->upload_cmd_cost + qxl->upload_byte_cost * bytes;
+}
+
 static void
-upload_one_primary_region(qxl_screen_t *qxl, PixmapPtr pixmap, BoxPtr b)
+box_union (BoxPtr dst, const BoxRec *a, const BoxRec *b)
+{
+    dst->x1 = a->x1 < b->x1 ? a->x1 : b->x1;
+    dst->y1 = a->y1 < b->y1 ? a->y1 : b->y1;
+    dst->x2 = a->x2 > b->x2 ? a->x2 : b->x2;
+    dst->y2 = a->y2 > b->y2 ? a->y2 : b->y2;
+}
+
+static int64_t
+boxes_area (const BoxRec *boxes, int n)
+{
+    int64_t area = 0;
+
+    while (n--)
+    {
+	area += (int64_t)(boxes->x2 - boxes->x1) * (boxes->y2 - boxes->y1);
+	boxes++;
+    }
+    return area;
+}
+
+/* Fills @plan, which must have room for COALESCE_MAX_INPUT boxes, and
+ * returns the number of rectangles in it. Without @what nothing is
+ * logged, and the function only reads @qxl. */
+static int
+coalesce_boxes (qxl_screen_t *qxl, const char *what, RegionPtr valid,
+		const BoxRec *boxes, int n_boxes, int cpp, BoxPtr plan)
+{
+    int group = (n_boxes + COALESCE_MAX_INPUT - 1) / COALESCE_MAX_INPUT;
+    int n = 0;
+    int i, j;
+
+    /* Region boxes come sorted in bands, so runs of them are close
+     * together; fold runs first to keep the search below bounded. */
+    if (group > 1 && valid)
+    {
+	/* folding could step outside @valid; fall back to the extents,
+	 * which is what the callers did before for large regions */
+	plan[0] = *REGION_EXTENTS (NULL, valid);
+	n_boxes = 1;
+	group = 1;
+	boxes = plan;
+    }
+    for (i = 0; i < n_boxes; i += group)
+    {
+	plan[n] = boxes[i];
+	for (j = i + 1; j < i + group && j < n_boxes; j++)
+	    box_union (&plan[n], &plan[n], &boxes[j]);
+	n++;
+    }
+
+    while (n > 1)
+    {
+	int64_t best_gain = INT64_MIN;
+	int best_i = -1, best_j = -1;
+
+	for (i = 0; i < n; i++)
+	{
+	    int64_t cost_i = box_cost (qxl, &plan[i], cpp);
+
+	    for (j = i + 1; j < n && j <= i + COALESCE_WINDOW; j++)
+	    {
+		BoxRec u;
+		int64_t gain;
+
+		box_union (&u, &plan[i], &plan[j]);
+		gain = cost_i + box_cost (qxl, &plan[j], cpp) - box_cost (qxl, &u, cpp);
+		if (gain > best_gain &&
+		    (!valid || RECT_IN_REGION (NULL, valid, &u) == rgnIN))
+		{
+		    best_gain = gain;
+		    best_i = i;
+		    best_j = j;
+		}
+	    }
+	}
+
+	if (best_i < 0 || (best_gain <= 0 && n <= COALESCE_MAX_BOXES))
+	    break;
+
+	box_union (&plan[best_i], &plan[best_i], &plan[best_j]);
+	memmove (&plan[best_j], &plan[best_j + 1], (n - best_j - 1) * sizeof (BoxRec));
+	n--;
+    }
+
+    if (qxl->debug_upload_plans && what)
+    {
+	ErrorF ("%s: %d boxes (%lld pixels) -> %d rects (%lld pixels)\n",
+		what, n_boxes, (long long)boxes_area (boxes, n_boxes),
+		n, (long long)boxes_area (plan, n));
+    }
+
+    return n;
+}
+
+/* Draws @image_bo, a copy of @b, onto the primary and drops the
+ * reference to it. */
+static void
+push_primary_image(qxl_screen_t *qxl, BoxPtr b, struct qxl_bo *image_bo)
 {
     struct QXLRect rect;
-    struct qxl_bo *drawable_bo, *image_bo;
+    struct qxl_bo *drawable_bo;
     struct QXLDrawable *drawable;
-    FbBits *data;
-    int stride;
-    int bpp;
 
     rect.left = b->x1;
     rect.right = b->x2;
     rect.top = b->y1;
     rect.bottom = b->y2;
 
-    drawable_bo = make_drawable (qxl, qxl->primary, QXL_DRAW_COPY, &rect);
+    drawable_bo = make_drawable (qxl, qxl->primary, QXL_DRAW_COPY, &rect, NULL, 0);
     drawable = qxl->bo_funcs->bo_map(drawable_bo);
     drawable->u.copy.src_area = rect;
     translate_rect (&drawable->u.copy.src_area);
@@ -307,10 +635,6 @@ upload_one_primary_region(qxl_screen_t *qxl, PixmapPtr pixmap, BoxPtr b)
     drawable->u.copy.mask.bitmap = 0;
     qxl->bo_funcs->bo_unmap(drawable_bo);
 
-    fbGetPixmapBitsData(pixmap, data, stride, bpp);
-    image_bo = qxl_image_create (
-	qxl, (const uint8_t *)data, b->x1, b->y1, b->x2 - b->x1, b->y2 - b->y1, stride * sizeof(*data),
-	bpp == 24 ? 4 : bpp / 8, TRUE);
     qxl->bo_funcs->bo_output_bo_reloc(qxl, offsetof(QXLDrawable, u.copy.src_bitmap),
 				   drawable_bo, image_bo);
 
@@ -318,20 +642,77 @@ upload_one_primary_region(qxl_screen_t *qxl, PixmapPtr pixmap, BoxPtr b)
     qxl->bo_funcs->bo_decref(qxl, image_bo);
 }
 
+static void
+upload_one_primary_region(qxl_screen_t *qxl, PixmapPtr pixmap, BoxPtr b)
+{
+    FbBits *data;
+    int stride;
+    int bpp;
+
+    fbGetPixmapBitsData(pixmap, data, stride, bpp);
+    push_primary_image (qxl, b, qxl_image_create (
+	qxl, (const uint8_t *)data, b->x1, b->y1, b->x2 - b->x1, b->y2 - b->y1,
+	stride * sizeof(*data), bpp == 24 ? 4 : bpp / 8, TRUE));
+}
+
+/* Plans an upload of @boxes without logging it, so that it can be run
+ * away from the X thread. @plan needs QXL_UPLOAD_PLAN_MAX entries. */
+int
+qxl_surface_plan_upload(qxl_screen_t *qxl, const BoxRec *boxes, int n_boxes, int cpp, BoxPtr plan)
+{
+    if (n_boxes <= 0)
+        return 0;
+
+    return coalesce_boxes (qxl, NULL, NULL, boxes, n_boxes, cpp, plan);
+}
+
+/* Draws @image_bo, an image of @b filled in by the caller, onto the
+ * primary. Takes over the reference to it. */
+void
+qxl_surface_upload_primary_bo(qxl_screen_t *qxl, BoxPtr b, struct qxl_bo *image_bo)
+{
+    push_primary_image (qxl, b, image_bo);
+}
+
+void
+qxl_surface_upload_primary_boxes(qxl_screen_t *qxl, PixmapPtr pixmap, BoxPtr boxes, int n_boxes)
+{
+    int bpp = pixmap->drawable.bitsPerPixel;
+    BoxRec plan[COALESCE_MAX_INPUT];
+    int i;
+
+    if (n_boxes <= 0)
+        return;
+
+    n_boxes = coalesce_boxes (qxl, "primary upload", NULL, boxes, n_boxes,
+                              bpp == 24 ? 4 : bpp / 8, plan);
+    for (i = 0; i < n_boxes; i++)
+        upload_one_primary_region(qxl, pixmap, &plan[i]);
+}
+
 void
 qxl_surface_upload_primary_regions(qxl_screen_t *qxl, PixmapPtr pixmap, RegionRec *r)
 {
-    int n_boxes;
-    BoxPtr boxes;
+    qxl_surface_upload_primary_boxes(qxl, pixmap, RegionRects(r), RegionNumRects(r));
+}
+
+/* Uploads @boxes of @surface from its host image, merged by upload
+ * cost. Merged rectangles stay inside @valid, if given; @what names the
+ * upload for the debug log. */
+void
+qxl_surface_upload_boxes (qxl_surface_t *surface, const char *what,
+			  RegionPtr valid, const BoxRec *boxes, int n_boxes)
+{
+    BoxRec plan[COALESCE_MAX_INPUT];
+    int i;
 
-    n_boxes = RegionNumRects(r);
-    boxes = RegionRects(r);
+    if (n_boxes <= 0)
+	return;
 
-    while (n_boxes--)
-    {
-        upload_one_primary_region(qxl, pixmap, boxes);
-        boxes++;
-    }
+    n_boxes = coalesce_boxes (surface->qxl, what, valid, boxes, n_boxes,
+			      surface->bpp == 24 ? 4 : surface->bpp / 8, plan);
+    for (i = 0; i < n_boxes; i++)
+	qxl_upload_box (surface, plan[i].x1, plan[i].y1, plan[i].x2, plan[i].y2);
 }
 
 void
@@ -343,37 +724,38 @@ qxl_surface_finish_access (qxl_surface_t *surface, PixmapPtr pixmap)
     int n_boxes;
     BoxPtr boxes;
 
-    n_boxes = REGION_NUM_RECTS (&surface->access_region);
-    boxes = REGION_RECTS (&surface->access_region);
+    /* only what was prepared for writing can differ from the device */
+    n_boxes = REGION_NUM_RECTS (&surface->access_rw_region);
+    boxes = REGION_RECTS (&surface->access_rw_region);
 
-    if (surface->access_type == UXA_ACCESS_RW)
+    if (surface->access_type == UXA_ACCESS_RW && n_boxes > 0 &&
+	dfps_hybrid_owns (surface))
     {
-	if (n_boxes < 25)
-	{
-	    while (n_boxes--)
-	    {
-		qxl_upload_box (surface, boxes->x1, boxes->y1, boxes->x2, boxes->y2);
-		
-		boxes++;
-	    }
-	}
-	else
-	{
-	    qxl_upload_box (surface,
-			surface->access_region.extents.x1,
-			surface->access_region.extents.y1,
-			surface->access_region.extents.x2,
-			surface->access_region.extents.y2);
-	}
+	dfps_hybrid_damage (surface->qxl, &surface->access_rw_region);
+	REGION_SUBTRACT (pScreen, &surface->host_valid,
+			 &surface->host_valid, &surface->access_rw_region);
+    }
+    else if (surface->access_type == UXA_ACCESS_RW && n_boxes > 0)
+    {
+	qxl_surface_upload_boxes (surface, "finish access", &surface->access_region,
+				  boxes, n_boxes);
     }
 
     REGION_EMPTY (pScreen, &surface->access_region);
+    REGION_EMPTY (pScreen, &surface->access_rw_region);
     surface->access_type = UXA_ACCESS_RO;
     
     pScreen->ModifyPixmapHeader(pixmap, w, h, -1, -1, 0, NULL);
 }
 
 
+/* TRUE between prepare_access and finish_access */
+Bool
+qxl_surface_has_access (qxl_surface_t *surface)
+{
+    return REGION_NOTEMPTY (NULL, &surface->access_region);
+}
+
 #ifdef DEBUG_REGIONS
 static void
 print_region (const char *header, RegionPtr pRegion)
@@ -399,11 +781,146 @@ print_region (const char *header, RegionPtr pRegion)
 }
 #endif // DEBUG_REGIONS
 
+/*
+ * Batches
+ *
+ * The boxes of a solid, copy or composite operation are collected and
+ * sent as one drawable covering their bounding box, with the boxes as
+ * its clip rectangles. All boxes of a batch have the same source and
+ * mask offsets; a different offset, a full batch or the end of the
+ * operation sends the batch.
+ */
+static void submit_copy (qxl_surface_t *dest, int src_x1, int src_y1,
+			 const struct QXLRect *rect, const BoxRec *clip, int n_clip);
+static void submit_composite (qxl_surface_t *dest, int src_x, int src_y,
+			      int mask_x, int mask_y, const struct QXLRect *rect,
+			      const BoxRec *clip, int n_clip);
+
+/* Boxes looked at when joining a new one; spans of shapes with holes
+ * alternate between a few columns. */
+#define BATCH_MERGE_WINDOW	4
+
+/* Join @box to a recent box it continues vertically or horizontally.
+ * The boxes of a batch share their colour or source offset and never
+ * overlap, so the order of the clip rectangles does not matter. */
+static Bool
+batch_merge (struct qxl_batch *batch, const BoxRec *box)
+{
+    int i;
+
+    for (i = batch->n_boxes - 1;
+	 i >= 0 && i >= batch->n_boxes - BATCH_MERGE_WINDOW; i--)
+    {
+	BoxPtr b = &batch->boxes[i];
+
+	if (b->x1 == box->x1 && b->x2 == box->x2 &&
+	    (b->y2 == box->y1 || b->y1 == box->y2))
+	{
+	    box_union (b, b, box);
+	    return TRUE;
+	}
+	if (b->y1 == box->y1 && b->y2 == box->y2 &&
+	    (b->x2 == box->x1 || b->x1 == box->x2))
+	{
+	    box_union (b, b, box);
+	    return TRUE;
+	}
+    }
+    return FALSE;
+}
+
+static void
+batch_add (qxl_surface_t *dest, int type,
+	   int x1, int y1, int x2, int y2,
+	   int src_dx, int src_dy, int mask_dx, int mask_dy)
+{
+    struct qxl_batch *batch = &dest->qxl->batch;
+    BoxRec box;
+
+    if (x1 >= x2 || y1 >= y2)
+	return;
+
+    if (batch->n_boxes &&
+	(batch->dest != dest || batch->type != type			||
+	 batch->src_dx != src_dx || batch->src_dy != src_dy		||
+	 batch->mask_dx != mask_dx || batch->mask_dy != mask_dy	||
+	 batch->n_boxes == QXL_BATCH_MAX_BOXES))
+    {
+	qxl_surface_flush (batch->dest);
+    }
+
+    box.x1 = x1;
+    box.y1 = y1;
+    box.x2 = x2;
+    box.y2 = y2;
+
+    if (!batch->n_boxes)
+    {
+	batch->dest = dest;
+	batch->type = type;
+	batch->src_dx = src_dx;
+	batch->src_dy = src_dy;
+	batch->mask_dx = mask_dx;
+	batch->mask_dy = mask_dy;
+	batch->extents = box;
+    }
+    else
+    {
+	box_union (&batch->extents, &batch->extents, &box);
+	if (batch_merge (batch, &box))
+	    return;
+    }
+    batch->boxes[batch->n_boxes++] = box;
+}
+
+void
+qxl_surface_flush (qxl_surface_t *surface)
+{
+    struct qxl_batch *batch = &surface->qxl->batch;
+    const BoxRec *clip;
+    struct QXLRect rect;
+
+    if (!batch->n_boxes || batch->dest != surface)
+	return;
+
+    /* a single box needs no clipping */
+    clip = batch->n_boxes > 1 ? batch->boxes : NULL;
+
+    rect.left = batch->extents.x1;
+    rect.top = batch->extents.y1;
+    rect.right = batch->extents.x2;
+    rect.bottom = batch->extents.y2;
+
+    switch (batch->type)
+    {
+    case QXL_DRAW_FILL:
+	submit_fill (surface->qxl, surface, &rect, clip, batch->n_boxes,
+		     surface->u.solid_pixel);
+	break;
+
+    case QXL_DRAW_COPY:
+	submit_copy (surface, rect.left + batch->src_dx, rect.top + batch->src_dy,
+		     &rect, clip, batch->n_boxes);
+	break;
+
+    case QXL_DRAW_COMPOSITE:
+	submit_composite (surface,
+			  rect.left + batch->src_dx, rect.top + batch->src_dy,
+			  rect.left + batch->mask_dx, rect.top + batch->mask_dy,
+			  &rect, clip, batch->n_boxes);
+	break;
+    }
+
+    batch->n_boxes = 0;
+}
+
 /* solid */
 Bool
 qxl_surface_prepare_solid (qxl_surface_t *destination,
 			   Pixel	  fg)
 {
+    qxl_surface_flush (destination);
+
     if (!REGION_NIL (&(destination->access_region)))
     {
 	ErrorF (" solid not in vmem\n");
@@ -425,18 +942,7 @@ qxl_surface_solid (qxl_surface_t *destination,
 		   int	          x2,
 		   int	          y2)
 {
-    qxl_screen_t *qxl = destination->qxl;
-    struct QXLRect qrect;
-    uint32_t p;
-
-    qrect.top = y1;
-    qrect.bottom = y2;
-    qrect.left = x1;
-    qrect.right = x2;
-
-    p = destination->u.solid_pixel;
-    
-    submit_fill (qxl, destination, &qrect, p);
+    batch_add (destination, QXL_DRAW_FILL, x1, y1, x2, y2, 0, 0, 0, 0);
 }
 
 /* copy */
@@ -444,6 +950,8 @@ Bool
 qxl_surface_prepare_copy (qxl_surface_t *dest,
 			  qxl_surface_t *source)
 {
+    qxl_surface_flush (dest);
+
     if (!REGION_NIL (&(dest->access_region))	||
 	!REGION_NIL (&(source->access_region)))
     {
@@ -482,30 +990,28 @@ static struct qxl_bo *image_from_surface(qxl_screen_t *qxl, qxl_surface_t *dest)
     return dest->image_bo;
 }
 
-void
-qxl_surface_copy (qxl_surface_t *dest,
-		  int  src_x1, int src_y1,
-		  int  dest_x1, int dest_y1,
-		  int width, int height)
+/* A batch of copies is sent as one: all of its boxes come from the same
+ * CopyArea, which behaves as if the whole source was read before any of
+ * the destination is written; a clipped COPY_BITS does the same. */
+static void
+submit_copy (qxl_surface_t *dest, int src_x1, int src_y1,
+	     const struct QXLRect *rect, const BoxRec *clip, int n_clip)
 {
     qxl_screen_t *qxl = dest->qxl;
     struct qxl_bo *drawable_bo;
     struct QXLDrawable *drawable;
-    struct QXLRect qrect;
+    struct QXLRect qrect = *rect;
+    int width = qrect.right - qrect.left;
+    int height = qrect.bottom - qrect.top;
 
 #ifdef DEBUG_REGIONS
     print_region (" copy src", &(dest->u.copy_src->access_region));
     print_region (" copy dest", &(dest->access_region));
 #endif
 
-    qrect.top = dest_y1;
-    qrect.bottom = dest_y1 + height;
-    qrect.left = dest_x1;
-    qrect.right = dest_x1 + width;
-    
     if (dest->id == dest->u.copy_src->id)
     {
-	drawable_bo = make_drawable (qxl, dest, QXL_COPY_BITS, &qrect);
+	drawable_bo = make_drawable (qxl, dest, QXL_COPY_BITS, &qrect, clip, n_clip);
 
 	drawable = qxl->bo_funcs->bo_map(drawable_bo);
 	drawable->u.copy_bits.src_pos.x = src_x1;
@@ -523,7 +1029,7 @@ qxl_surface_copy (qxl_surface_t *dest,
 
 	image_bo = image_from_surface(qxl, dest->u.copy_src);
 
-	drawable_bo = make_drawable (qxl, dest, QXL_DRAW_COPY, &qrect);
+	drawable_bo = make_drawable (qxl, dest, QXL_DRAW_COPY, &qrect, clip, n_clip);
 
 	drawable = qxl->bo_funcs->bo_map(drawable_bo);
 	qxl->bo_funcs->bo_output_bo_reloc(qxl, offsetof(QXLDrawable, u.copy.src_bitmap),
@@ -545,14 +1051,14 @@ qxl_surface_copy (qxl_surface_t *dest,
 	assert (src_x1 >= 0);
 	assert (src_y1 >= 0);
 
-	if (width > pixman_image_get_width (dest->u.copy_src->host_image))
+	if (width > pixman_image_get_width (dest->u.copy_src->dev_image))
 	{
 	    ErrorF ("dest w: %d   src w: %d\n",
-		    width, pixman_image_get_width (dest->u.copy_src->host_image));
+		    width, pixman_image_get_width (dest->u.copy_src->dev_image));
 	}
 	
-	assert (width <= pixman_image_get_width (dest->u.copy_src->host_image));
-	assert (height <= pixman_image_get_height (dest->u.copy_src->host_image));
+	assert (width <= pixman_image_get_width (dest->u.copy_src->dev_image));
+	assert (height <= pixman_image_get_height (dest->u.copy_src->dev_image));
 
 	qxl->bo_funcs->bo_unmap(drawable_bo);
 	push_drawable (qxl, drawable_bo);
@@ -560,6 +1066,17 @@ qxl_surface_copy (qxl_surface_t *dest,
     }
 }
 
+void
+qxl_surface_copy (qxl_surface_t *dest,
+		  int  src_x1, int src_y1,
+		  int  dest_x1, int dest_y1,
+		  int width, int height)
+{
+    batch_add (dest, QXL_DRAW_COPY,
+	       dest_x1, dest_y1, dest_x1 + width, dest_y1 + height,
+	       src_x1 - dest_x1, src_y1 - dest_y1, 0, 0);
+}
+
 /* composite */
 Bool
 qxl_surface_prepare_composite (int op,
@@ -570,6 +1087,8 @@ qxl_surface_prepare_composite (int op,
 			       qxl_surface_t *	mask,
 			       qxl_surface_t *	dest)
 {
+    qxl_surface_flush (dest);
+
     dest->u.composite.op = op;
     dest->u.composite.src_picture = src_picture;
     dest->u.composite.mask_picture = mask_picture;
@@ -595,27 +1114,76 @@ image_from_picture (qxl_screen_t *qxl,
     return image_from_surface(qxl, surface);
 }
 
+/* The returned object belongs to the transform cache: drawables take
+ * their own reference through the reloc and callers must not drop it. */
 static struct qxl_bo *
 get_transform (qxl_screen_t *qxl, PictTransform *transform)
 {
-    if (transform)
+    struct qxl_transform_entry *entry, *victim;
+    pixman_fixed_t matrix[6];
+    QXLTransform *qxform;
+    int i;
+
+    if (!transform)
+	return NULL;
+
+    matrix[0] = transform->matrix[0][0];
+    matrix[1] = transform->matrix[0][1];
+    matrix[2] = transform->matrix[0][2];
+    matrix[3] = transform->matrix[1][0];
+    matrix[4] = transform->matrix[1][1];
+    matrix[5] = transform->matrix[1][2];
+
+    victim = &qxl->transform_cache[0];
+    for (i = 0; i < QXL_TRANSFORM_CACHE_SIZE; ++i)
     {
-	struct qxl_bo *qxform_bo = qxl->bo_funcs->bo_alloc (qxl, sizeof (QXLTransform), "transform");
-	QXLTransform *qxform = qxl->bo_funcs->bo_map(qxform_bo);
+	entry = &qxl->transform_cache[i];
 
-	qxform->t00 = transform->matrix[0][0];
-	qxform->t01 = transform->matrix[0][1];
-	qxform->t02 = transform->matrix[0][2];
-	qxform->t10 = transform->matrix[1][0];
-	qxform->t11 = transform->matrix[1][1];
-	qxform->t12 = transform->matrix[1][2];
+	if (entry->bo && memcmp (entry->matrix, matrix, sizeof matrix) == 0)
+	{
+	    entry->last_used = ++qxl->transform_clock;
+	    return entry->bo;
+	}
 
-	qxl->bo_funcs->bo_unmap(qxform_bo);
-	return qxform_bo;
+	if (!entry->bo)
+	    victim = entry;
+	else if (victim->bo && entry->last_used < victim->last_used)
+	    victim = entry;
     }
-    else
+
+    if (victim->bo)
+	qxl->bo_funcs->bo_decref (qxl, victim->bo);
+
+    victim->bo = qxl->bo_funcs->bo_alloc (qxl, sizeof (QXLTransform), "transform");
+    qxform = qxl->bo_funcs->bo_map(victim->bo);
+
+    qxform->t00 = matrix[0];
+    qxform->t01 = matrix[1];
+    qxform->t02 = matrix[2];
+    qxform->t10 = matrix[3];
+    qxform->t11 = matrix[4];
+    qxform->t12 = matrix[5];
+
+    qxl->bo_funcs->bo_unmap(victim->bo);
+
+    memcpy (victim->matrix, matrix, sizeof matrix);
+    victim->last_used = ++qxl->transform_clock;
+
+    return victim->bo;
+}
+
+void
+qxl_surface_reset_transform_cache (qxl_screen_t *qxl, Bool release)
+{
+    int i;
+
+    for (i = 0; i < QXL_TRANSFORM_CACHE_SIZE; ++i)
     {
-	return NULL;
+	struct qxl_transform_entry *entry = &qxl->transform_cache[i];
+
+	if (release && entry->bo)
+	    qxl->bo_funcs->bo_decref (qxl, entry->bo);
+	entry->bo = NULL;
     }
 }
 
@@ -623,8 +1191,8 @@ static QXLRect
 full_rect (qxl_surface_t *surface)
 {
     QXLRect r;
-    int w = pixman_image_get_width (surface->host_image);
-    int h = pixman_image_get_height (surface->host_image);
+    int w = pixman_image_get_width (surface->dev_image);
+    int h = pixman_image_get_height (surface->dev_image);
 	    
     r.left = r.top = 0;
     r.right = w;
@@ -633,12 +1201,110 @@ full_rect (qxl_surface_t *surface)
     return r;
 }
 
-void
-qxl_surface_composite (qxl_surface_t *dest,
-		       int src_x, int src_y,
-		       int mask_x, int mask_y,
-		       int dest_x, int dest_y,
-		       int width, int height)
+/* The part of @surface that @pict reads when it is composited from
+ * (@x, @y) over a @width by @height area, widened by a pixel for the
+ * filter when there is a transform. Returns FALSE, with @area set to
+ * the whole surface, when that is not known or is empty. */
+static Bool
+picture_area (PicturePtr pict, qxl_surface_t *surface,
+	      int x, int y, int width, int height, QXLRect *area)
+{
+    QXLRect full = full_rect (surface);
+    pixman_box16_t box;
+
+    *area = full;
+
+    if (pict->repeat || pict->filter == PictFilterConvolution)
+	return FALSE;
+
+    if (x < MINSHORT || y < MINSHORT ||
+	x + width > MAXSHORT || y + height > MAXSHORT)
+	return FALSE;
+
+    box.x1 = x;
+    box.y1 = y;
+    box.x2 = x + width;
+    box.y2 = y + height;
+
+    if (pict->transform)
+    {
+	if (!pixman_transform_bounds (pict->transform, &box))
+	    return FALSE;
+
+	box.x1 -= 1;
+	box.y1 -= 1;
+	box.x2 += 1;
+	box.y2 += 1;
+    }
+
+    if (box.x1 > full.left)
+	area->left = box.x1;
+    if (box.y1 > full.top)
+	area->top = box.y1;
+    if (box.x2 < full.right)
+	area->right = box.x2;
+    if (box.y2 < full.bottom)
+	area->bottom = box.y2;
+
+    if (area->left >= area->right || area->top >= area->bottom)
+    {
+	*area = full;
+	return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* With these operators a transparent source, or a transparent mask,
+ * leaves the destination as it is */
+static Bool
+composite_skips_transparent (int op)
+{
+    switch (op)
+    {
+    case PictOpOver:
+    case PictOpOverReverse:
+    case PictOpOutReverse:
+    case PictOpXor:
+    case PictOpAdd:
+	return TRUE;
+
+    default:
+	return FALSE;
+    }
+}
+
+/* Shrink @rect to the part of @bbox where an untransformed @pict,
+ * read from (@x, @y) at the top left of @bbox, has pixels */
+static void
+crop_to_picture (QXLRect *rect, const struct QXLRect *bbox,
+		 PicturePtr pict, qxl_surface_t *surface, int x, int y)
+{
+    int dx = bbox->left - x;
+    int dy = bbox->top - y;
+    QXLRect area;
+
+    if (pict->transform ||
+	!picture_area (pict, surface, x, y,
+		       bbox->right - bbox->left, bbox->bottom - bbox->top, &area))
+    {
+	return;
+    }
+
+    if (rect->left < area.left + dx)
+	rect->left = area.left + dx;
+    if (rect->top < area.top + dy)
+	rect->top = area.top + dy;
+    if (rect->right > area.right + dx)
+	rect->right = area.right + dx;
+    if (rect->bottom > area.bottom + dy)
+	rect->bottom = area.bottom + dy;
+}
+
+static void
+submit_composite (qxl_surface_t *dest, int src_x, int src_y,
+		  int mask_x, int mask_y, const struct QXLRect *bbox,
+		  const BoxRec *clip, int n_clip)
 {
     qxl_screen_t *qxl = dest->qxl;
     PicturePtr src = dest->u.composite.src_picture;
@@ -649,11 +1315,11 @@ qxl_surface_composite (qxl_surface_t *dest,
     struct QXLDrawable *drawable;
     struct qxl_bo *drawable_bo;
     QXLComposite *composite;
-    QXLRect rect;
+    QXLRect rect, area;
     struct qxl_bo *trans_bo, *img_bo;
     int n_deps = 0;
     int force_opaque;
-    struct qxl_bo *derefs[4];
+    struct qxl_bo *derefs[2];
     int n_derefs = 0, i;
 #if 0
     ErrorF ("QXL Composite: src:       %x (%d %d) id: %d; \n"
@@ -665,17 +1331,32 @@ qxl_surface_composite (qxl_surface_t *dest,
 	    dest->u.composite.src->id,
 	    dest->u.composite.mask? dest->u.composite.mask->id : -1,
 	    dest->u.composite.dest_picture->format,
-	    dest_x, dest_y, width, height,
+	    bbox->left, bbox->top,
+	    bbox->right - bbox->left, bbox->bottom - bbox->top,
 	    dest->id
 	);
 #endif
 
-    rect.left = dest_x;
-    rect.right = dest_x + width;
-    rect.top = dest_y;
-    rect.bottom = dest_y + height;
+    rect = *bbox;
+
+    /* Nothing is drawn where a non-repeating source or mask has no
+     * pixels, so leave that out of the bounding box */
+    if (composite_skips_transparent (op))
+    {
+	crop_to_picture (&rect, bbox, src, qsrc, src_x, src_y);
+	if (mask)
+	    crop_to_picture (&rect, bbox, mask, qmask, mask_x, mask_y);
+
+	if (rect.left >= rect.right || rect.top >= rect.bottom)
+	    return;
+
+	src_x += rect.left - bbox->left;
+	src_y += rect.top - bbox->top;
+	mask_x += rect.left - bbox->left;
+	mask_y += rect.top - bbox->top;
+    }
     
-    drawable_bo = make_drawable (qxl, dest, QXL_DRAW_COMPOSITE, &rect);
+    drawable_bo = make_drawable (qxl, dest, QXL_DRAW_COMPOSITE, &rect, clip, n_clip);
 
     drawable = qxl->bo_funcs->bo_map(drawable_bo);
 
@@ -701,12 +1382,13 @@ qxl_surface_composite (qxl_surface_t *dest,
     if (trans_bo) {
 	qxl->bo_funcs->bo_output_bo_reloc(qxl, offsetof(QXLDrawable, u.composite.src_transform),
 				       drawable_bo, trans_bo);
-	derefs[n_derefs++] = trans_bo;
     } else
 	composite->src_transform = 0;
 
     qxl->bo_funcs->bo_output_surf_reloc(qxl, offsetof(struct QXLDrawable, surfaces_dest[n_deps]), drawable_bo, qsrc);
-    drawable->surfaces_rects[n_deps] = full_rect (qsrc);
+    picture_area (src, qsrc, src_x, src_y,
+		  rect.right - rect.left, rect.bottom - rect.top, &area);
+    drawable->surfaces_rects[n_deps] = area;
 
     n_deps++;
     
@@ -724,14 +1406,15 @@ qxl_surface_composite (qxl_surface_t *dest,
 	composite->flags |= (mask->componentAlpha << 18);
 
 	qxl->bo_funcs->bo_output_surf_reloc(qxl, offsetof(struct QXLDrawable, surfaces_dest[n_deps]), drawable_bo, qmask);
-	drawable->surfaces_rects[n_deps] = full_rect (qmask);
+	picture_area (mask, qmask, mask_x, mask_y,
+		      rect.right - rect.left, rect.bottom - rect.top, &area);
+	drawable->surfaces_rects[n_deps] = area;
 	n_deps++;
 	
-	trans_bo = get_transform (qxl, src->transform);
+	trans_bo = get_transform (qxl, mask->transform);
 	if (trans_bo) {
 	    qxl->bo_funcs->bo_output_bo_reloc(qxl, offsetof(QXLDrawable, u.composite.mask_transform),
 					   drawable_bo, trans_bo);
-	    derefs[n_derefs++] = trans_bo;
 	}
 	else
 	  composite->mask_transform = 0;
@@ -743,7 +1426,7 @@ qxl_surface_composite (qxl_surface_t *dest,
     }
 
     qxl->bo_funcs->bo_output_surf_reloc(qxl, offsetof(struct QXLDrawable, surfaces_dest[n_deps]), drawable_bo, dest);
-    drawable->surfaces_rects[n_deps] = full_rect (dest);
+    drawable->surfaces_rects[n_deps] = rect;
     
     composite->src_origin.x = src_x;
     composite->src_origin.y = src_y;
@@ -759,6 +1442,18 @@ qxl_surface_composite (qxl_surface_t *dest,
       qxl->bo_funcs->bo_decref(qxl, derefs[i]);
 }
 
+void
+qxl_surface_composite (qxl_surface_t *dest,
+		       int src_x, int src_y,
+		       int mask_x, int mask_y,
+		       int dest_x, int dest_y,
+		       int width, int height)
+{
+    batch_add (dest, QXL_DRAW_COMPOSITE,
+	       dest_x, dest_y, dest_x + width, dest_y + height,
+	       src_x - dest_x, src_y - dest_y, mask_x - dest_x, mask_y - dest_y);
+}
+
 Bool
 qxl_surface_put_image (qxl_surface_t *dest,
 		       int x, int y, int width, int height,
@@ -775,7 +1470,7 @@ qxl_surface_put_image (qxl_surface_t *dest,
     rect.top = y;
     rect.bottom = y + height;
 
-    drawable_bo = make_drawable (qxl, dest, QXL_DRAW_COPY, &rect);
+    drawable_bo = make_drawable (qxl, dest, QXL_DRAW_COPY, &rect, NULL, 0);
 
     drawable = qxl->bo_funcs->bo_map(drawable_bo);
     drawable->u.copy.src_area.top = 0;
@@ -803,6 +1498,41 @@ qxl_surface_put_image (qxl_surface_t *dest,
     return TRUE;
 }
 
+/* Read a box straight from the device image into @dst, leaving the
+ * host image and the access region alone. */
+Bool
+qxl_surface_get_image (qxl_surface_t *src,
+		       int x, int y, int width, int height,
+		       char *dst, int dst_pitch)
+{
+    qxl_screen_t *qxl = src->qxl;
+    pixman_image_t *dst_image;
+
+    if (!qxl->pScrn->vtSema)
+	return FALSE;
+
+    if ((dst_pitch & 3) || ((uintptr_t)dst & 3))
+	return FALSE;
+
+    if (qxl->batch.n_boxes)
+	qxl_surface_flush (qxl->batch.dest);
+
+    dst_image = pixman_image_create_bits (
+	pixman_image_get_format (src->dev_image),
+	width, height, (uint32_t *)dst, dst_pitch);
+    if (!dst_image)
+	return FALSE;
+
+    qxl->bo_funcs->update_area (src, x, y, x + width, y + height);
+
+    pixman_image_composite (PIXMAN_OP_SRC,
+			    src->dev_image, NULL, dst_image,
+			    x, y, 0, 0, 0, 0, width, height);
+
+    pixman_image_unref (dst_image);
+    return TRUE;
+}
+
 void
 qxl_get_formats (int bpp, SpiceSurfaceFmt *format, pixman_format_code_t *pformat)
 {
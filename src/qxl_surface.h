@@ -15,6 +15,16 @@ struct qxl_surface_t
 
     uxa_access_t	access_type;
     RegionRec		access_region;
+    RegionRec		access_rw_region;	/* part of access_region
+						 * prepared for writing */
+    RegionRec		host_valid;	/* where host_image still matches
+					 * the device */
+
+    /* Surfaces holding a host_image, most recently accessed first. The
+     * primary keeps its host image and is not on the list. */
+    struct qxl_surface_t *	host_next;
+    struct qxl_surface_t *	host_prev;
+    CARD32		host_used;
 
     struct qxl_bo   *bo;
     struct qxl_surface_t *	next;
@@ -49,6 +59,10 @@ struct qxl_surface_t
     struct qxl_bo *image_bo;
 };
 
+Bool qxl_surface_alloc_host_image (qxl_surface_t *surface);
+void qxl_surface_free_host_image (qxl_surface_t *surface);
+void qxl_surface_set_host_image (qxl_surface_t *surface, pixman_image_t *image);
+
 void qxl_download_box (qxl_surface_t *surface, int x1, int y1, int x2, int y2);
 void qxl_upload_box (qxl_surface_t *surface, int x1, int y1, int x2, int y2);
 
@@ -59,8 +59,10 @@ typedef struct evacuated_surface_t evacuated_surface_t;
 
 struct evacuated_surface_t
 {
-    pixman_image_t	*image;
+    pixman_image_t	*image;		/* NULL if the contents were lost */
     PixmapPtr		 pixmap;
+    int			 width;
+    int			 height;
     int			 bpp;
 
     evacuated_surface_t *prev;
@@ -164,6 +166,10 @@ surface_cache_init (surface_cache_t *cache, qxl_screen_t *qxl)
 	
 	REGION_INIT (
 	    NULL, &(cache->all_surfaces[i].access_region), (BoxPtr)NULL, 0);
+	REGION_INIT (
+	    NULL, &(cache->all_surfaces[i].access_rw_region), (BoxPtr)NULL, 0);
+	REGION_INIT (
+	    NULL, &(cache->all_surfaces[i].host_valid), (BoxPtr)NULL, 0);
 	cache->all_surfaces[i].access_type = UXA_ACCESS_RO;
 
 	if (i) /* surface 0 is the primary surface */
@@ -249,8 +255,8 @@ surface_get_from_cache (surface_cache_t *cache, int width, int height, int bpp)
 
 	if (s && bpp == s->bpp)
 	{
-	    int w = pixman_image_get_width (s->host_image);
-	    int h = pixman_image_get_height (s->host_image);
+	    int w = pixman_image_get_width (s->dev_image);
+	    int h = pixman_image_get_height (s->dev_image);
 	    
 	    if (width <= w && width * 4 > w && height <= h && height * 4 > h)
 	    {
@@ -344,6 +350,8 @@ qxl_surface_cache_create_primary (qxl_screen_t *qxl,
     surface->image_bo = NULL;
     
     REGION_INIT (NULL, &(surface->access_region), (BoxPtr)NULL, 0);
+    REGION_INIT (NULL, &(surface->access_rw_region), (BoxPtr)NULL, 0);
+    REGION_INIT (NULL, &(surface->host_valid), (BoxPtr)NULL, 0);
     surface->access_type = UXA_ACCESS_RO;
     
     return surface;
@@ -514,8 +522,8 @@ retry:
     surface->dev_image = pixman_image_create_bits (
 	pformat, width, height, dev_addr, - stride);
 
-    surface->host_image = pixman_image_create_bits (
-	pformat, width, height, NULL, -1);
+    /* the host copy is allocated on the first fallback */
+    surface->host_image = NULL;
 
     qxl->bo_funcs->bo_unmap(surface->bo);
     surface->bpp = bpp;
@@ -573,6 +581,9 @@ qxl_surface_create (qxl_screen_t *qxl,
 	if (!(surface = surface_send_create (cache, width, height, bpp)))
 	    return NULL;
 
+    /* a recycled surface keeps the pixels of its previous pixmap */
+    REGION_EMPTY (NULL, &surface->host_valid);
+
     surface->next = cache->live_surfaces;
     surface->prev = NULL;
     if (cache->live_surfaces)
@@ -619,8 +630,7 @@ surface_destroy (qxl_surface_t *surface)
 
     if (surface->dev_image)
 	pixman_image_unref (surface->dev_image);
-    if (surface->host_image)
-	pixman_image_unref (surface->host_image);
+    qxl_surface_free_host_image (surface);
 
 #if 0
     ErrorF("destroy %ld\n", (long int)surface->end - (long int)surface->address);
@@ -742,9 +752,9 @@ qxl_surface_kill (qxl_surface_t *surface)
     }
 
     if (surface->id != 0					&&
-        surface->host_image                                     &&
-	pixman_image_get_width (surface->host_image) >= 128	&&
-	pixman_image_get_height (surface->host_image) >= 128)
+        surface->dev_image                                      &&
+	pixman_image_get_width (surface->dev_image) >= 128	&&
+	pixman_image_get_height (surface->dev_image) >= 128)
     {
 	surface_add_to_cache (surface);
     }
@@ -776,19 +786,31 @@ qxl_surface_cache_evacuate_all (surface_cache_t *cache)
 	evacuated_surface_t *evacuated = malloc (sizeof (evacuated_surface_t));
 	int width, height;
 
-	width = pixman_image_get_width (s->host_image);
-	height = pixman_image_get_height (s->host_image);
+	width = pixman_image_get_width (s->dev_image);
+	height = pixman_image_get_height (s->dev_image);
 
-	qxl_download_box (s, 0, 0, width, height);
-
-	evacuated->image = s->host_image;
+	/* Without room for a copy the surface still comes back, with
+	 * its contents lost, so that the pixmap keeps a surface */
+	if (qxl_surface_alloc_host_image (s))
+	{
+	    qxl_download_box (s, 0, 0, width, height);
+	    evacuated->image = pixman_image_ref (s->host_image);
+	}
+	else
+	{
+	    ErrorF ("%s: no memory to save a %dx%d surface\n",
+		    __FUNCTION__, width, height);
+	    evacuated->image = NULL;
+	}
 	evacuated->pixmap = s->pixmap;
 
 	assert (get_surface (evacuated->pixmap) == s);
 	
+	evacuated->width = width;
+	evacuated->height = height;
 	evacuated->bpp = s->bpp;
 	
-	s->host_image = NULL;
+	qxl_surface_free_host_image (s);
 
 	unlink_surface (s);
 	
@@ -822,19 +844,20 @@ qxl_surface_cache_replace_all (surface_cache_t *cache, void *data)
     while (ev != NULL)
     {
 	evacuated_surface_t *next = ev->next;
-	int width = pixman_image_get_width (ev->image);
-	int height = pixman_image_get_height (ev->image);
+	int width = ev->width;
+	int height = ev->height;
 	qxl_surface_t *surface;
 
 	surface = qxl_surface_create (cache->qxl, width, height, ev->bpp);
 
-	assert (surface->host_image);
 	assert (surface->dev_image);
 
-	pixman_image_unref (surface->host_image);
-	surface->host_image = ev->image;
+	if (ev->image)
+	{
+	    qxl_surface_set_host_image (surface, ev->image);
 
-	qxl_upload_box (surface, 0, 0, width, height);
+	    qxl_upload_box (surface, 0, 0, width, height);
+	}
 
 	set_surface (ev->pixmap, surface);
 
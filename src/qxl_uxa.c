@@ -33,33 +33,239 @@
 #include "config.h"
 #endif
 
+#include <inttypes.h>
+
 #include "qxl.h"
 #include "dfps.h"
 #include <spice/protocol.h>
 
 #if HAS_DEVPRIVATEKEYREC
 DevPrivateKeyRec uxa_pixmap_index;
+static DevPrivateKeyRec qxl_pixmap_info_index;
 #else
 int uxa_pixmap_index;
+static int qxl_pixmap_info_index;
 #endif
 
+/*
+ * Pixmap migration
+ *
+ * With migration enabled, pixmaps are created in host memory that the
+ * driver allocates itself. They still claim to be offscreen so that uxa
+ * offers every operation on them to the driver: prepare hooks count
+ * accelerated uses and prepare_access counts fallbacks. An operation
+ * that the driver turns down only because a pixmap is still in host
+ * memory counts as a use of that pixmap, and the fallback uxa makes
+ * for it is not held against any of its pixmaps. A pixmap whose score
+ * reaches pixmap_promote_score is uploaded into a new surface, and a
+ * surface pixmap whose score falls to -pixmap_demote_score is read back
+ * and loses its surface.
+ */
+#define PIXMAP_SCORE_MAX	20
+
+struct qxl_pixmap_info
+{
+    int		score;
+    Bool	host;	/* bits are in driver allocated host memory */
+    Bool	solid;	/* 1x1 surface pixmap whose pixel is color */
+    CARD32	color;
+    Bool	declined; /* next access is a fallback the driver chose */
+};
+
+static struct qxl_pixmap_info *
+get_pixmap_info (PixmapPtr pixmap)
+{
+#if HAS_DEVPRIVATEKEYREC
+    return dixGetPrivateAddr (&pixmap->devPrivates, &qxl_pixmap_info_index);
+#else
+    return dixLookupPrivateAddr (&pixmap->devPrivates, &qxl_pixmap_info_index);
+#endif
+}
+
+static qxl_screen_t *
+pixmap_qxl (PixmapPtr pixmap)
+{
+    return xf86ScreenToScrn (pixmap->drawable.pScreen)->driverPrivate;
+}
+
+static qxl_surface_t *
+pixmap_promote (qxl_screen_t *qxl, PixmapPtr pixmap)
+{
+    struct qxl_pixmap_info *info = get_pixmap_info (pixmap);
+    int w = pixmap->drawable.width;
+    int h = pixmap->drawable.height;
+    qxl_surface_t *surface;
+
+    surface = qxl->bo_funcs->create_surface (qxl, w, h, pixmap->drawable.depth);
+    if (!surface)
+    {
+	/* try again after another round of uses */
+	info->score = 0;
+	qxl->pixmap_stats.promote_failed++;
+	return NULL;
+    }
+
+    qxl_surface_put_image (surface, 0, 0, w, h,
+			   pixmap->devPrivate.ptr, pixmap->devKind);
+
+    /* remember the colour of solid pictures, the device copy cannot be
+     * read cheaply */
+    if (w == 1 && h == 1 && pixmap->drawable.bitsPerPixel == 32)
+    {
+	info->solid = TRUE;
+	info->color = *(CARD32 *)pixmap->devPrivate.ptr;
+    }
+
+    free (pixmap->devPrivate.ptr);
+    pixmap->drawable.pScreen->ModifyPixmapHeader (pixmap, w, h,
+						  -1, -1, -1, NULL);
+
+    info->host = FALSE;
+    set_surface (pixmap, surface);
+    qxl_surface_set_pixmap (surface, pixmap);
+
+    qxl->pixmap_stats.promoted++;
+    return surface;
+}
+
+static Bool
+pixmap_demote (qxl_screen_t *qxl, PixmapPtr pixmap, qxl_surface_t *surface)
+{
+    struct qxl_pixmap_info *info = get_pixmap_info (pixmap);
+    int w = pixmap->drawable.width;
+    int h = pixmap->drawable.height;
+    int stride = PixmapBytePad (w, pixmap->drawable.depth);
+    void *bits;
+
+    if (!(bits = malloc (stride * h)))
+	return FALSE;
+
+    if (!qxl_surface_get_image (surface, 0, 0, w, h, bits, stride))
+    {
+	free (bits);
+	return FALSE;
+    }
+
+    qxl->bo_funcs->destroy_surface (surface);
+    set_surface (pixmap, NULL);
+
+    pixmap->drawable.pScreen->ModifyPixmapHeader (pixmap, w, h,
+						  -1, -1, stride, bits);
+
+    info->host = TRUE;
+    info->score = 0;
+
+    qxl->pixmap_stats.demoted++;
+    return TRUE;
+}
+
+/* Returns the surface of @pixmap for an operation that the caller can
+ * otherwise accelerate. A pixmap in host memory gets a point for it and
+ * is promoted once it has enough; until then it has no surface, and the
+ * operation is expected to be declined. */
+static qxl_surface_t *
+pixmap_surface (PixmapPtr pixmap)
+{
+    struct qxl_pixmap_info *info = get_pixmap_info (pixmap);
+    qxl_surface_t *surface = get_surface (pixmap);
+    qxl_screen_t *qxl = pixmap_qxl (pixmap);
+
+    if (surface || !info->host)
+	return surface;
+
+    if (info->score < PIXMAP_SCORE_MAX)
+	info->score++;
+
+    if (info->score >= qxl->pixmap_promote_score)
+	surface = pixmap_promote (qxl, pixmap);
+
+    if (!surface)
+	info->declined = TRUE;
+
+    return surface;
+}
+
+/* Marks @pixmap as taking part in an operation that is declined because
+ * of a pixmap in host memory */
+static void
+pixmap_decline (PixmapPtr pixmap)
+{
+    if (pixmap)
+	get_pixmap_info (pixmap)->declined = TRUE;
+}
+
+/* Counts an accelerated use of @pixmap, which is drawn to if @write,
+ * once the operation has been accepted */
+static void
+pixmap_accept (PixmapPtr pixmap, Bool write)
+{
+    struct qxl_pixmap_info *info = get_pixmap_info (pixmap);
+
+    /* pixmap_surface has already counted a pixmap left in host memory */
+    if (!info->host && info->score < PIXMAP_SCORE_MAX)
+	info->score++;
+
+    if (write)
+	info->solid = FALSE;
+
+    info->declined = FALSE;
+}
+
 static Bool
 qxl_prepare_access (PixmapPtr pixmap, RegionPtr region, uxa_access_t access)
 {
-    return qxl_surface_prepare_access (get_surface (pixmap),
-                                       pixmap, region, access);
+    struct qxl_pixmap_info *info = get_pixmap_info (pixmap);
+    qxl_surface_t *surface = get_surface (pixmap);
+    qxl_screen_t *qxl = pixmap_qxl (pixmap);
+
+    if (info->declined)
+	info->declined = FALSE;
+    else if (info->score > -PIXMAP_SCORE_MAX)
+	info->score--;
+
+    if (access == UXA_ACCESS_RW)
+	info->solid = FALSE;
+
+    if (info->host)
+	return TRUE;
+
+    /* an access that is already open keeps using the host image */
+    if (qxl->pixmap_demote_score				&&
+	surface != qxl->primary					&&
+	info->score <= -qxl->pixmap_demote_score		&&
+	!qxl_surface_has_access (surface)			&&
+	pixmap_demote (qxl, pixmap, surface))
+    {
+	return TRUE;
+    }
+
+    return qxl_surface_prepare_access (surface, pixmap, region, access);
 }
 
 static void
 qxl_finish_access (PixmapPtr pixmap)
 {
+    struct qxl_pixmap_info *info = get_pixmap_info (pixmap);
+
+    if (info->host)
+	return;
+
+    /* the host copy of the pixel is current here: this is how
+     * uxa_create_solid() fills in solid pictures */
+    if (pixmap->drawable.width == 1 && pixmap->drawable.height == 1 &&
+	pixmap->drawable.bitsPerPixel == 32 && pixmap->devPrivate.ptr)
+    {
+	info->solid = TRUE;
+	info->color = *(CARD32 *)pixmap->devPrivate.ptr;
+    }
+
     qxl_surface_finish_access (get_surface (pixmap), pixmap);
 }
 
 static Bool
 qxl_pixmap_is_offscreen (PixmapPtr pixmap)
 {
-    return !!get_surface (pixmap);
+    return get_surface (pixmap) || get_pixmap_info (pixmap)->host;
 }
 
 static Bool
@@ -74,6 +280,21 @@ good_alu_and_pm (DrawablePtr drawable, int alu, Pixel planemask)
     return TRUE;
 }
 
+/* Counts the operation for the hybrid mode load monitor, and returns
+ * TRUE if @surface is the primary while its updates are deferred: it is
+ * then drawn in software only and must be neither the destination nor a
+ * source of device drawing.
+ */
+static Bool
+hybrid_deferred (PixmapPtr dest, qxl_surface_t *surface)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn (dest->drawable.pScreen);
+
+    dfps_hybrid_note_op (pScrn->driverPrivate);
+
+    return dfps_hybrid_owns (surface);
+}
+
 /*
  * Solid fill
  */
@@ -91,10 +312,17 @@ qxl_prepare_solid (PixmapPtr pixmap, int alu, Pixel planemask, Pixel fg)
 {
     qxl_surface_t *surface;
 
-    if (!(surface = get_surface (pixmap)))
+    if (hybrid_deferred (pixmap, get_surface (pixmap)))
+	return FALSE;
+
+    if (!(surface = pixmap_surface (pixmap)))
 	return FALSE;
 
-    return qxl_surface_prepare_solid (surface, fg);
+    if (!qxl_surface_prepare_solid (surface, fg))
+	return FALSE;
+
+    pixmap_accept (pixmap, TRUE);
+    return TRUE;
 }
 
 static void
@@ -106,6 +334,7 @@ qxl_solid (PixmapPtr pixmap, int x1, int y1, int x2, int y2)
 static void
 qxl_done_solid (PixmapPtr pixmap)
 {
+    qxl_surface_flush (get_surface (pixmap));
 }
 
 /*
@@ -132,7 +361,42 @@ qxl_prepare_copy (PixmapPtr source, PixmapPtr dest,
                   int xdir, int ydir, int alu,
                   Pixel planemask)
 {
-    return qxl_surface_prepare_copy (get_surface (dest), get_surface (source));
+    qxl_surface_t *dest_surface, *source_surface;
+
+    if (hybrid_deferred (dest, get_surface (dest)) ||
+	dfps_hybrid_owns (get_surface (source)))
+    {
+	return FALSE;
+    }
+
+    if (!(dest_surface = pixmap_surface (dest)))
+    {
+	if (get_pixmap_info (dest)->host)
+	    pixmap_decline (source);
+	return FALSE;
+    }
+
+    source_surface = pixmap_surface (source);
+
+    if (!source_surface)
+    {
+	qxl_screen_t *qxl = pixmap_qxl (dest);
+
+	if (!get_pixmap_info (source)->host)
+	    return FALSE;
+
+	/* not worth a surface yet: send the boxes as images */
+	qxl_surface_flush (dest_surface);
+	qxl->copy_host_src = source;
+    }
+    else if (!qxl_surface_prepare_copy (dest_surface, source_surface))
+    {
+	return FALSE;
+    }
+
+    pixmap_accept (dest, TRUE);
+    pixmap_accept (source, FALSE);
+    return TRUE;
 }
 
 static void
@@ -141,6 +405,21 @@ qxl_copy (PixmapPtr dest,
           int dest_x1, int dest_y1,
           int width, int height)
 {
+    qxl_screen_t *qxl = pixmap_qxl (dest);
+    PixmapPtr source = qxl->copy_host_src;
+
+    if (source)
+    {
+	const char *bits = (const char *)source->devPrivate.ptr +
+	    src_y1 * source->devKind +
+	    src_x1 * (source->drawable.bitsPerPixel / 8);
+
+	qxl_surface_put_image (get_surface (dest), dest_x1, dest_y1,
+			       width, height, bits, source->devKind);
+	qxl->pixmap_stats.host_copies++;
+	return;
+    }
+
     qxl_surface_copy (get_surface (dest),
                       src_x1, src_y1,
                       dest_x1, dest_y1,
@@ -150,6 +429,8 @@ qxl_copy (PixmapPtr dest,
 static void
 qxl_done_copy (PixmapPtr dest)
 {
+    pixmap_qxl (dest)->copy_host_src = NULL;
+    qxl_surface_flush (get_surface (dest));
 }
 
 /*
@@ -343,6 +624,86 @@ qxl_check_composite_texture (ScreenPtr screen,
     return TRUE;
 }
 
+/* The colour of a 1x1 32 bit pixmap, if it can be had without reading
+ * back from the device */
+static Bool
+pixmap_solid_color (PixmapPtr pixmap, CARD32 *color)
+{
+    struct qxl_pixmap_info *info = get_pixmap_info (pixmap);
+
+    if (pixmap->drawable.width != 1		||
+	pixmap->drawable.height != 1		||
+	pixmap->drawable.bitsPerPixel != 32)
+    {
+	return FALSE;
+    }
+
+    if (info->host)
+	*color = *(CARD32 *)pixmap->devPrivate.ptr;
+    else if (info->solid)
+	*color = info->color;
+    else
+	return FALSE;
+
+    return TRUE;
+}
+
+/* The colour of a solid composite source: a solid fill picture, or a
+ * repeating 1x1 pixmap. @pSrc is NULL for pictures without a drawable. */
+static Bool
+picture_solid_color (PicturePtr src, PixmapPtr pSrc, CARD32 *color)
+{
+    if (!pSrc)
+    {
+	if (!src->pSourcePict ||
+	    src->pSourcePict->type != SourcePictTypeSolidFill)
+	{
+	    return FALSE;
+	}
+
+	*color = src->pSourcePict->solidFill.color;
+	return TRUE;
+    }
+
+    if (!src->repeat)
+	return FALSE;
+
+    return pixmap_solid_color (pSrc, color);
+}
+
+/* A solid source composited without a mask with Src, or Over with an
+ * opaque colour, just fills the destination. */
+static Bool
+composite_fill_pixel (int op, PicturePtr src, PicturePtr mask,
+		      PicturePtr dst, PixmapPtr pSrc, CARD32 *pixel)
+{
+    CARD32 color;
+
+    if (mask)
+	return FALSE;
+
+    if (op != PictOpSrc && op != PictOpOver)
+	return FALSE;
+
+    if ((src->format != PICT_a8r8g8b8 && src->format != PICT_x8r8g8b8) ||
+	(dst->format != PICT_a8r8g8b8 && dst->format != PICT_x8r8g8b8))
+    {
+	return FALSE;
+    }
+
+    if (!picture_solid_color (src, pSrc, &color))
+	return FALSE;
+
+    if (src->format == PICT_x8r8g8b8)
+	color |= 0xff000000;
+
+    if (op == PictOpOver && (color >> 24) != 0xff)
+	return FALSE;
+
+    *pixel = color;
+    return TRUE;
+}
+
 static Bool
 qxl_prepare_composite (int op,
 		       PicturePtr pSrcPicture,
@@ -352,11 +713,82 @@ qxl_prepare_composite (int op,
 		       PixmapPtr pMask,
 		       PixmapPtr pDst)
 {
-    return qxl_surface_prepare_composite (
-	op, pSrcPicture, pMaskPicture, pDstPicture,
-	get_surface (pSrc),
-	pMask? get_surface (pMask) : NULL,
-	get_surface (pDst));
+    qxl_screen_t *qxl = pixmap_qxl (pDst);
+    qxl_surface_t *dst, *src, *mask;
+    CARD32 pixel;
+    Bool fill;
+
+    if (hybrid_deferred (pDst, get_surface (pDst)))
+	return FALSE;
+
+    fill = composite_fill_pixel (op, pSrcPicture, pMaskPicture, pDstPicture,
+				 pSrc, &pixel);
+
+    if (!fill)
+    {
+	/* gradients and other pictures without a drawable have no
+	 * surface */
+	if (!pSrc || (pMaskPicture && !pMask))
+	    return FALSE;
+
+	if (dfps_hybrid_owns (get_surface (pSrc)) ||
+	    (pMask && dfps_hybrid_owns (get_surface (pMask))))
+	{
+	    return FALSE;
+	}
+    }
+
+    if (!(dst = pixmap_surface (pDst)))
+    {
+	if (get_pixmap_info (pDst)->host && !fill)
+	{
+	    pixmap_decline (pSrc);
+	    pixmap_decline (pMask);
+	}
+	return FALSE;
+    }
+
+    if (fill)
+    {
+	if (!qxl_surface_prepare_solid (dst, pixel))
+	    return FALSE;
+
+	pixmap_accept (pDst, TRUE);
+	qxl->composite_fill = TRUE;
+	qxl->pixmap_stats.composite_fills++;
+	return TRUE;
+    }
+
+    /* solid pictures are kept in the uxa solid cache, so a surface made
+     * for one serves every later use of its colour */
+    if (pMask && pixmap_solid_color (pSrc, &pixel) &&
+	get_pixmap_info (pSrc)->host)
+    {
+	get_pixmap_info (pSrc)->score = qxl->pixmap_promote_score;
+    }
+
+    src = pixmap_surface (pSrc);
+    mask = pMask ? pixmap_surface (pMask) : NULL;
+
+    if (!src || (pMask && !mask))
+    {
+	pixmap_decline (pDst);
+	pixmap_decline (pSrc);
+	pixmap_decline (pMask);
+	return FALSE;
+    }
+
+    if (!qxl_surface_prepare_composite (
+	    op, pSrcPicture, pMaskPicture, pDstPicture, src, mask, dst))
+    {
+	return FALSE;
+    }
+
+    pixmap_accept (pDst, TRUE);
+    pixmap_accept (pSrc, FALSE);
+    if (pMask)
+	pixmap_accept (pMask, FALSE);
+    return TRUE;
 }
 
 static void
@@ -366,6 +798,13 @@ qxl_composite (PixmapPtr pDst,
 	       int dst_x, int dst_y,
 	       int width, int height)
 {
+    if (pixmap_qxl (pDst)->composite_fill)
+    {
+	qxl_surface_solid (get_surface (pDst),
+			   dst_x, dst_y, dst_x + width, dst_y + height);
+	return;
+    }
+
     qxl_surface_composite (
 	get_surface (pDst),
 	src_x, src_y,
@@ -376,17 +815,56 @@ qxl_composite (PixmapPtr pDst,
 static void
 qxl_done_composite (PixmapPtr pDst)
 {
-    ;
+    pixmap_qxl (pDst)->composite_fill = FALSE;
+    qxl_surface_flush (get_surface (pDst));
 }
 
 static Bool
 qxl_put_image (PixmapPtr pDst, int x, int y, int w, int h,
                char *src, int src_pitch)
 {
-    qxl_surface_t *surface = get_surface (pDst);
+    struct qxl_pixmap_info *info = get_pixmap_info (pDst);
+    int bpp = pDst->drawable.bitsPerPixel;
+    qxl_surface_t *surface;
+
+    /* a pixmap in host memory is written directly, so that the upload
+     * does not count as a fallback; the device is not involved, so it
+     * is not scored as a use either */
+    if (info->host)
+    {
+	if (src_pitch & 3)
+	    return FALSE;
+
+	info->solid = FALSE;
+	return pixman_blt ((uint32_t *)src, pDst->devPrivate.ptr,
+			   src_pitch / 4, pDst->devKind / 4, bpp, bpp,
+			   0, 0, x, y, w, h);
+    }
+
+    surface = get_surface (pDst);
+
+    if (hybrid_deferred (pDst, surface))
+	return FALSE;
+
+    if (!surface || !qxl_surface_put_image (surface, x, y, w, h, src, src_pitch))
+	return FALSE;
+
+    pixmap_accept (pDst, TRUE);
+    return TRUE;
+}
+
+static Bool
+qxl_get_image (PixmapPtr pSrc, int x, int y, int w, int h,
+	       char *dst, int dst_pitch)
+{
+    qxl_surface_t *surface = get_surface (pSrc);
+
+    /* the host copy is newer than the device while updates are deferred */
+    if (dfps_hybrid_owns (surface))
+	return FALSE;
 
     if (surface)
-	return qxl_surface_put_image (surface, x, y, w, h, src, src_pitch);
+	return qxl_surface_get_image (surface, x, y, w, h, dst, dst_pitch);
 
     return FALSE;
 }
@@ -429,6 +907,23 @@ qxl_create_pixmap (ScreenPtr screen, int w, int h, int depth, unsigned usage)
     if (!w || !h)
       goto fallback;
 
+    if (qxl->pixmap_promote_score > 0 && qxl->enable_surfaces	&&
+	(depth == 8 || depth == 16 || depth == 24 || depth == 32))
+    {
+	int stride = PixmapBytePad (w, depth);
+	void *bits = malloc (stride * h);
+
+	if (!bits)
+	    goto fallback;
+
+	pixmap = fbCreatePixmap (screen, 0, 0, depth, usage);
+	screen->ModifyPixmapHeader (pixmap, w, h, -1, -1, stride, bits);
+	get_pixmap_info (pixmap)->host = TRUE;
+
+	qxl->pixmap_stats.host_created++;
+	return pixmap;
+    }
+
     surface = qxl->bo_funcs->create_surface (qxl, w, h, depth);
     if (surface)
     {
@@ -490,6 +985,10 @@ qxl_destroy_pixmap (PixmapPtr pixmap)
 
 	    qxl_surface_cache_sanity_check (qxl->surface_cache);
 	}
+	else if (get_pixmap_info (pixmap)->host)
+	{
+	    free (pixmap->devPrivate.ptr);
+	}
     }
 
     fbDestroyPixmap (pixmap);
@@ -522,6 +1021,9 @@ set_uxa_functions(qxl_screen_t *qxl, ScreenPtr screen)
     /* PutImage */
     qxl->uxa->put_image = qxl_put_image;
 
+    /* GetImage */
+    qxl->uxa->get_image = qxl_get_image;
+
     /* Prepare access */
     qxl->uxa->prepare_access = qxl_prepare_access;
     qxl->uxa->finish_access = qxl_finish_access;
@@ -533,6 +1035,21 @@ set_uxa_functions(qxl_screen_t *qxl, ScreenPtr screen)
     screen->DestroyPixmap = qxl_destroy_pixmap;
 }
 
+void
+qxl_uxa_dump_stats (qxl_screen_t *qxl)
+{
+    struct qxl_pixmap_stats *s = &qxl->pixmap_stats;
+
+    if (qxl->pixmap_promote_score)
+    {
+	ErrorF ("pixmaps created in host memory: %" PRIu64 "\n", s->host_created);
+	ErrorF ("  promoted: %" PRIu64 " (%" PRIu64 " failed), demoted: %" PRIu64 "\n",
+		s->promoted, s->promote_failed, s->demoted);
+	ErrorF ("  boxes copied from host pixmaps: %" PRIu64 "\n", s->host_copies);
+    }
+    ErrorF ("solid composites sent as fills: %" PRIu64 "\n", s->composite_fills);
+}
+
 Bool
 qxl_uxa_init (qxl_screen_t *qxl, ScreenPtr screen)
 {
@@ -541,9 +1058,15 @@ qxl_uxa_init (qxl_screen_t *qxl, ScreenPtr screen)
 #if HAS_DIXREGISTERPRIVATEKEY
     if (!dixRegisterPrivateKey (&uxa_pixmap_index, PRIVATE_PIXMAP, 0))
 	return FALSE;
+    if (!dixRegisterPrivateKey (&qxl_pixmap_info_index, PRIVATE_PIXMAP,
+				sizeof (struct qxl_pixmap_info)))
+	return FALSE;
 #else
     if (!dixRequestPrivate (&uxa_pixmap_index, 0))
 	return FALSE;
+    if (!dixRequestPrivate (&qxl_pixmap_info_index,
+			    sizeof (struct qxl_pixmap_info)))
+	return FALSE;
 #endif
 
     qxl->uxa = uxa_driver_alloc ();
@@ -23,6 +23,14 @@
 #include "config.h"
 #endif
 
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
 #include <spice.h>
 
 #include "qxl.h"
@@ -130,75 +138,179 @@ static void interface_get_init_info(QXLInstance *sin, QXLDevInitInfo *info)
     info->n_surfaces = NUM_SURFACES;
 }
 
+/* Upper bound on the number of resources freed per wakeup of the X
+ * thread, so a large release burst does not stall input handling */
+#define QXL_RELEASE_GC_BUDGET 256
+
+/* Not a device interrupt: Xspice has none, and the release ring is the
+ * only thing the X thread is woken up for */
+#define XSPICE_EVENT_RELEASE (1u << 31)
+
 void qxl_send_events(qxl_screen_t *qxl, int events)
 {
-#if 0
-    ErrorF("qxl_send_events %d\n", events);
-    qxl_garbage_collect(qxl);
-#endif
-    /* we should trigger a garbage collection, but via a pipe. TODO */
+    uint64_t one = 1;
+
+    if (!(events & XSPICE_EVENT_RELEASE) || qxl->release_event_fd < 0) {
+        return;
+    }
+    /* eventfd keeps a counter, so signals that arrive before the X
+     * thread gets around to reading it collapse into one wakeup */
+    if (write(qxl->release_event_fd, &one, sizeof(one)) != sizeof(one) &&
+        errno != EAGAIN) {
+        fprintf(stderr, "%s: write failed: %s\n", __FUNCTION__, strerror(errno));
+    }
+}
+
+/* called from X thread context only */
+static void qxl_release_event(int fd, int event, void *opaque)
+{
+    qxl_screen_t *qxl = opaque;
+    uint64_t count;
+
+    if (read(fd, &count, sizeof(count)) != sizeof(count)) {
+        return;
+    }
+    if (!qxl->release_ring || !qxl->mem) {
+        return;
+    }
+    if (qxl_garbage_collect_bounded(qxl, QXL_RELEASE_GC_BUDGET) >=
+        QXL_RELEASE_GC_BUDGET) {
+        /* more may be waiting, come back on the next loop iteration */
+        qxl_send_events(qxl, XSPICE_EVENT_RELEASE);
+    }
 }
 
 /* called from spice server thread context only */
-static int interface_get_command(QXLInstance *sin, struct QXLCommandExt *ext)
+static void qxl_signal_release(qxl_screen_t *qxl)
 {
-    qxl_screen_t *qxl = container_of(sin, qxl_screen_t, display_sin);
-    QXLRam *ram = get_ram_header(qxl);
-    QXLCommandRing *ring;
-    QXLCommand *cmd;
-    int notify;
+    pthread_mutex_lock(&qxl->release_lock);
+    qxl->release_gen++;
+    pthread_cond_broadcast(&qxl->release_cond);
+    pthread_mutex_unlock(&qxl->release_lock);
+}
 
-    dprint(qxl, 2, "%s: %s\n", __FUNCTION__,
-           qxl->cmdflags ? "compat" : "native");
-    ring = &ram->cmd_ring;
-    if (SPICE_RING_IS_EMPTY(ring)) {
-        return FALSE;
+/* Release batching: resources are published in batches sized so that
+ * a batch fills in about half of the release deadline at the current
+ * release rate. Memory pressure in qxl->mem shrinks the batches, a
+ * backed up release ring grows them, and nothing is held longer than
+ * the deadline or across the worker going idle. */
+#define QXL_FREE_BATCH_MIN          1
+#define QXL_FREE_BATCH_MAX          512
+#define QXL_RELEASE_RATE_PERIOD     (100 * 1000 * 1000ULL) /* ns */
+
+enum {
+    QXL_RELEASE_PUSH_BATCH,
+    QXL_RELEASE_PUSH_IDLE,
+    QXL_RELEASE_PUSH_FLUSH,
+};
+
+static uint64_t qxl_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* called from spice server thread context only */
+static void qxl_update_release_rate(qxl_screen_t *qxl, uint64_t now)
+{
+    uint64_t elapsed = now - qxl->release_rate_stamp;
+    uint32_t rate;
+
+    qxl->release_rate_count++;
+    if (elapsed < QXL_RELEASE_RATE_PERIOD) {
+        return;
     }
-    SPICE_RING_CONS_ITEM(ring, cmd);
-    ext->cmd      = *cmd;
-    ext->group_id = MEMSLOT_GROUP;
-    ext->flags    = qxl->cmdflags;
-    SPICE_RING_POP(ring, notify);
-    if (notify) {
-        qxl_send_events(qxl, QXL_INTERRUPT_DISPLAY);
+    rate = qxl->release_rate_count * 1000000000ULL / elapsed;
+    /* smooth a little so a single burst does not dominate */
+    qxl->release_rate = (qxl->release_rate * 3 + rate) / 4;
+    qxl->release_rate_count = 0;
+    qxl->release_rate_stamp = now;
+}
+
+/* called from spice server thread context only */
+static uint32_t qxl_release_batch_target(qxl_screen_t *qxl,
+                                         QXLReleaseRing *ring)
+{
+    uint64_t target;
+    int free_pct = qxl->mem ? qxl_mem_free_percent(qxl->mem) : 100;
+
+    target = (uint64_t)qxl->release_rate * qxl->release_deadline / 2000;
+    if (ring->prod - ring->cons > ring->num_items / 2) {
+        /* X is not keeping up with the ring, use fewer slots */
+        target *= 2;
     }
-    qxl->guest_primary.commands++;
-    // TODO: reenable, useful
-    //qxl_track_command(qxl, ext);
-    //qxl_log_command(qxl, "cmd", ext);
-    return TRUE;
+    if (free_pct < 10) {
+        target = QXL_FREE_BATCH_MIN;
+    } else if (free_pct < 25 && target > 8) {
+        target = 8;
+    }
+    if (target < QXL_FREE_BATCH_MIN) {
+        target = QXL_FREE_BATCH_MIN;
+    } else if (target > QXL_FREE_BATCH_MAX) {
+        target = QXL_FREE_BATCH_MAX;
+    }
+    return target;
 }
 
 /* called from spice server thread context only */
-static int interface_req_cmd_notification(QXLInstance *sin)
+static void qxl_account_free_res(qxl_screen_t *qxl, int reason, uint64_t held)
 {
-    qxl_screen_t *qxl = container_of(sin, qxl_screen_t, display_sin);
-    QXLRam *header = get_ram_header(qxl);
-    int wait = 1;
+    struct qxl_release_stats *stats = &qxl->release_stats;
+    uint32_t n = qxl->num_free_res;
 
-    SPICE_RING_CONS_WAIT(&header->cmd_ring, wait);
-    return wait;
+    stats->batches++;
+    stats->resources += n;
+    if (n > stats->max_batch) {
+        stats->max_batch = n;
+    }
+    stats->sizes[n < 2 ? 0 : n < 8 ? 1 : n < 32 ? 2 : n < 128 ? 3 : 4]++;
+    stats->hold_total += held;
+    if (held > stats->hold_max) {
+        stats->hold_max = held;
+    }
+    switch (reason) {
+    case QXL_RELEASE_PUSH_IDLE:
+        stats->by_idle++;
+        break;
+    case QXL_RELEASE_PUSH_FLUSH:
+        stats->by_flush++;
+        break;
+    default:
+        if (held >= qxl->release_deadline * 1000000ULL) {
+            stats->by_deadline++;
+        } else {
+            stats->by_size++;
+        }
+        break;
+    }
 }
 
 /* called from spice server thread context only */
-static inline void qxl_push_free_res(qxl_screen_t *qxl, int flush)
+static inline void qxl_push_free_res(qxl_screen_t *qxl, int reason)
 {
     QXLRam *header = get_ram_header(qxl);
     QXLReleaseRing *ring = &header->release_ring;
     uint64_t *item;
+    uint64_t held;
     int notify;
 
-#define QXL_FREE_BUNCH_SIZE 32
-
+    if (qxl->num_free_res == 0) {
+        return;
+    }
     if (ring->prod - ring->cons + 1 == ring->num_items) {
         /* ring full -- can't push */
         return;
     }
-    if (!flush && qxl->oom_running) {
+    if (reason == QXL_RELEASE_PUSH_BATCH && qxl->oom_running) {
         /* collect everything from oom handler before pushing */
         return;
     }
-    if (!flush && qxl->num_free_res < QXL_FREE_BUNCH_SIZE) {
+    held = qxl_now_ns() - qxl->release_first;
+    if (reason == QXL_RELEASE_PUSH_BATCH &&
+        qxl->num_free_res < qxl_release_batch_target(qxl, ring) &&
+        held < qxl->release_deadline * 1000000ULL) {
         /* collect a bit more before pushing */
         return;
     }
@@ -208,13 +320,63 @@ static inline void qxl_push_free_res(qxl_screen_t *qxl, int flush)
            qxl->num_free_res, notify ? "yes" : "no",
            ring->prod - ring->cons, ring->num_items,
            ring->prod, ring->cons);
-    if (notify) {
-        qxl_send_events(qxl, QXL_INTERRUPT_DISPLAY);
-    }
+    /* always wake the X thread: it does not poll the release ring
+     * between allocations, and Xspice has no interrupt to rely on */
+    qxl_send_events(qxl, XSPICE_EVENT_RELEASE);
     SPICE_RING_PROD_ITEM(ring, item);
     *item = 0;
+    qxl_account_free_res(qxl, reason, held);
     qxl->num_free_res = 0;
     qxl->last_release = NULL;
+    qxl_signal_release(qxl);
+}
+
+/* called from spice server thread context only */
+static int interface_get_command(QXLInstance *sin, struct QXLCommandExt *ext)
+{
+    qxl_screen_t *qxl = container_of(sin, qxl_screen_t, display_sin);
+    QXLRam *ram = get_ram_header(qxl);
+    QXLCommandRing *ring;
+    QXLCommand *cmd;
+    int notify;
+
+    dprint(qxl, 2, "%s: %s\n", __FUNCTION__,
+           qxl->cmdflags ? "compat" : "native");
+    ring = &ram->cmd_ring;
+    if (SPICE_RING_IS_EMPTY(ring)) {
+        return FALSE;
+    }
+    SPICE_RING_CONS_ITEM(ring, cmd);
+    ext->cmd      = *cmd;
+    ext->group_id = MEMSLOT_GROUP;
+    ext->flags    = qxl->cmdflags;
+    SPICE_RING_POP(ring, notify);
+    if (notify) {
+        qxl_send_events(qxl, QXL_INTERRUPT_DISPLAY);
+    }
+    qxl->guest_primary.commands++;
+    /* a busy worker may not release anything for a while, so
+     * check the deadline of a held batch here too */
+    qxl_push_free_res(qxl, QXL_RELEASE_PUSH_BATCH);
+    // TODO: reenable, useful
+    //qxl_track_command(qxl, ext);
+    //qxl_log_command(qxl, "cmd", ext);
+    return TRUE;
+}
+
+/* called from spice server thread context only */
+static int interface_req_cmd_notification(QXLInstance *sin)
+{
+    qxl_screen_t *qxl = container_of(sin, qxl_screen_t, display_sin);
+    QXLRam *header = get_ram_header(qxl);
+    int wait = 1;
+
+    SPICE_RING_CONS_WAIT(&header->cmd_ring, wait);
+    if (wait) {
+        /* going idle, nothing will come along to fill the batch */
+        qxl_push_free_res(qxl, QXL_RELEASE_PUSH_IDLE);
+    }
+    return wait;
 }
 
 /* called from spice server thread context only */
@@ -225,6 +387,7 @@ static void interface_release_resource(QXLInstance *sin,
     QXLRam *ram = get_ram_header(qxl);
     QXLReleaseRing *ring;
     uint64_t *item, id;
+    uint64_t now = qxl_now_ns();
 
     /*
      * ext->info points into guest-visible memory
@@ -243,9 +406,12 @@ static void interface_release_resource(QXLInstance *sin,
         ext.info->next = 0;
     }
     qxl->last_release = ext.info;
-    qxl->num_free_res++;
+    if (qxl->num_free_res++ == 0) {
+        qxl->release_first = now;
+    }
+    qxl_update_release_rate(qxl, now);
     dprint(qxl, 3, "%4d\r", qxl->num_free_res);
-    qxl_push_free_res(qxl, 0);
+    qxl_push_free_res(qxl, QXL_RELEASE_PUSH_BATCH);
 }
 
 /* called from spice server thread context only */
@@ -303,7 +469,11 @@ static int interface_flush_resources(QXLInstance *sin)
     dprint(qxl, 1, "free: guest flush (have %d)\n", qxl->num_free_res);
     ret = qxl->num_free_res;
     if (ret) {
-        qxl_push_free_res(qxl, 1);
+        qxl_push_free_res(qxl, QXL_RELEASE_PUSH_FLUSH);
+    } else {
+        /* the worker calls this at the end of OOM handling, let a
+         * waiting X thread know there is nothing more coming */
+        qxl_signal_release(qxl);
     }
     return ret;
 }
@@ -336,11 +506,27 @@ static const QXLInterface qxl_interface = {
 
 void qxl_add_spice_display_interface(qxl_screen_t *qxl)
 {
+    pthread_condattr_t attr;
+
     /* use this function to initialize the parts of qxl_screen_t
      * that were added directly from qemu/hw/qxl.c */
     qxl->cmdflags = 0;
     qxl->oom_running = 0;
     qxl->num_free_res = 0;
+    qxl->release_rate = 0;
+    qxl->release_rate_count = 0;
+    qxl->release_rate_stamp = qxl_now_ns();
+    memset(&qxl->release_stats, 0, sizeof(qxl->release_stats));
+    qxl->release_gen = 0;
+    pthread_mutex_init(&qxl->release_lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&qxl->release_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    /* opened by spiceqxl_display_open_release_event */
+    qxl->release_event_fd = -1;
+    qxl->release_watch = NULL;
 
     qxl->display_sin.base.sif = &qxl_interface.base;
     qxl->display_sin.id = 0;
@@ -348,6 +534,59 @@ void qxl_add_spice_display_interface(qxl_screen_t *qxl)
     spice_server_add_interface(qxl->spice_server, &qxl->display_sin.base);
 }
 
+/* Called on screen init, before the worker is started */
+void spiceqxl_display_open_release_event(qxl_screen_t *qxl)
+{
+    if (qxl->release_event_fd >= 0) {
+        return;
+    }
+    qxl->release_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (qxl->release_event_fd < 0) {
+        fprintf(stderr, "%s: eventfd failed: %s, released resources will only "
+                "be collected on allocation\n", __FUNCTION__, strerror(errno));
+        return;
+    }
+    qxl->release_watch = qxl->core->watch_add(qxl->release_event_fd,
+                                              SPICE_WATCH_EVENT_READ,
+                                              qxl_release_event, qxl);
+}
+
+/* Called on screen close, once the worker is stopped */
+void spiceqxl_display_close_release_event(qxl_screen_t *qxl)
+{
+    int fd = qxl->release_event_fd;
+
+    if (fd < 0) {
+        return;
+    }
+    qxl->release_event_fd = -1;
+    if (qxl->release_watch) {
+        qxl->core->watch_remove(qxl->release_watch);
+        qxl->release_watch = NULL;
+    }
+    close(fd);
+}
+
+void spiceqxl_display_dump_stats(qxl_screen_t *qxl)
+{
+    struct qxl_release_stats *stats = &qxl->release_stats;
+
+    if (!stats->batches) {
+        return;
+    }
+    ErrorF("release batches: %" PRIu64 " (%" PRIu64 " resources, max %u)\n",
+           stats->batches, stats->resources, stats->max_batch);
+    ErrorF("  sizes 1: %" PRIu64 " 2-7: %" PRIu64 " 8-31: %" PRIu64
+           " 32-127: %" PRIu64 " 128+: %" PRIu64 "\n",
+           stats->sizes[0], stats->sizes[1], stats->sizes[2],
+           stats->sizes[3], stats->sizes[4]);
+    ErrorF("  pushed on size: %" PRIu64 " deadline: %" PRIu64
+           " idle: %" PRIu64 " flush: %" PRIu64 "\n",
+           stats->by_size, stats->by_deadline, stats->by_idle, stats->by_flush);
+    ErrorF("  hold time avg: %" PRIu64 " us, max: %" PRIu64 " us\n",
+           stats->hold_total / stats->batches / 1000, stats->hold_max / 1000);
+}
+
 void spiceqxl_display_monitors_config(qxl_screen_t *qxl)
 {
     spice_qxl_monitors_config_async(&qxl->display_sin, (QXLPHYSICAL)qxl->monitors_config,
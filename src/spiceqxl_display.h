@@ -31,5 +31,8 @@ void qxl_add_spice_display_interface(qxl_screen_t *qxl);
 void qxl_send_events(qxl_screen_t *qxl, int events);
 
 void spiceqxl_display_monitors_config(qxl_screen_t *qxl);
+void spiceqxl_display_dump_stats(qxl_screen_t *qxl);
+void spiceqxl_display_open_release_event(qxl_screen_t *qxl);
+void spiceqxl_display_close_release_event(qxl_screen_t *qxl);
 
 #endif // QXL_SPICE_DISPLAY_H
@@ -35,6 +35,7 @@
 #include <xkbsrv.h>
 #include <spice.h>
 #include "qxl.h"
+#include "dfps.h"
 #include "spiceqxl_inputs.h"
 
 static
@@ -46,6 +47,21 @@ void XSpicePointerUnInit(InputDriverPtr drv, InputInfoPtr pInfo, int flags);
 static
 void XSpiceKeyboardUnInit(InputDriverPtr drv, InputInfoPtr pInfo, int flags);
 
+/* screen whose last_input_time is kept up to date */
+static qxl_screen_t *g_xspice_qxl;
+
+/* Presses ask for an early frame; motion only counts as activity, or
+ * moving the mouse would run deferred FPS at full rate. */
+static void xspice_input_activity(Bool press)
+{
+    if (g_xspice_qxl) {
+        g_xspice_qxl->last_input_time = GetTimeInMillis();
+        if (press) {
+            dfps_input_notify(g_xspice_qxl);
+        }
+    }
+}
+
 static char xspice_pointer_name[] = "xspice pointer";
 static InputDriverRec XSPICE_POINTER = {
     1,
@@ -251,6 +267,7 @@ static void kbd_push_key(SpiceKbdInstance *sin, uint8_t frag)
     }
 
     xf86PostKeyboardEvent(kbd->pInfo->dev, frag, is_down);
+    xspice_input_activity(TRUE);
 }
 
 static uint8_t kbd_get_leds(SpiceKbdInstance *sin)
@@ -310,6 +327,7 @@ void spiceqxl_tablet_position(int x, int y, uint32_t buttons_state)
 {
     // TODO: don't ignore buttons_state
     xf86PostMotionEvent(g_xspice_pointer->pInfo->dev, 1, 0, 2, x, y);
+    xspice_input_activity(FALSE);
 }
 
 static void tablet_position(SpiceTabletInstance* sin, int x, int y,
@@ -330,6 +348,7 @@ void spiceqxl_tablet_buttons(uint32_t buttons_state)
         }
     }
     old_buttons_state = buttons_state;
+    xspice_input_activity(TRUE);
 }
 
 static void tablet_buttons(SpiceTabletInstance *sin,
@@ -417,6 +436,11 @@ XSpiceKeyboardUnInit(InputDriverPtr drv, InputInfoPtr pInfo, int flags)
 {
 }
 
+void spiceqxl_inputs_set_screen(qxl_screen_t *qxl)
+{
+    g_xspice_qxl = qxl;
+}
+
 void xspice_add_input_drivers(pointer module)
 {
     xf86AddInputDriver(&XSPICE_POINTER, module, 0);
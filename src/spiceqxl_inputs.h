@@ -26,6 +26,7 @@
 #include "qxl.h"
 
 void xspice_add_input_drivers(pointer module);
+void spiceqxl_inputs_set_screen(qxl_screen_t *qxl);
 void spiceqxl_tablet_buttons(uint32_t buttons_state);
 void spiceqxl_tablet_position(int x, int y, uint32_t buttons_state);
 
@@ -23,8 +23,9 @@
 #include "config.h"
 #endif
 
+#include <errno.h>
 #include <pthread.h>
-#include <sched.h>
+#include <time.h>
 
 #include <spice.h>
 
@@ -91,6 +92,44 @@ void xspice_init_qxl_ram(qxl_screen_t *qxl)
     *item = 0;
 }
 
+/* Bounds a single QXL_IO_NOTIFY_OOM; qxl_allocnf retries up to 1000
+ * times, which keeps the overall limit at the old 10 seconds */
+#define QXL_OOM_WAIT_MS 10
+
+/* Ask the worker to free what it can, then sleep until it has pushed
+ * something to the release ring or given up, or the wait times out. */
+static void qxl_notify_oom(qxl_screen_t *qxl)
+{
+    struct timespec deadline;
+    uint32_t gen;
+    int ret = 0;
+
+    pthread_mutex_lock(&qxl->release_lock);
+    gen = qxl->release_gen;
+    pthread_mutex_unlock(&qxl->release_lock);
+
+    spice_qxl_oom(&qxl->display_sin);
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_nsec += QXL_OOM_WAIT_MS * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&qxl->release_lock);
+    while (qxl->release_gen == gen && ret == 0) {
+        ret = pthread_cond_timedwait(&qxl->release_cond,
+                                     &qxl->release_lock, &deadline);
+    }
+    pthread_mutex_unlock(&qxl->release_lock);
+
+    if (ret == ETIMEDOUT) {
+        dprint(1, "QXL_IO_NOTIFY_OOM: no release after %d ms\n",
+               QXL_OOM_WAIT_MS);
+    }
+}
+
 static void qxl_reset_state(qxl_screen_t *qxl)
 {
     QXLRam *ram = get_ram_header(qxl);
@@ -234,11 +273,7 @@ void ioport_write(qxl_screen_t *qxl, uint32_t io_port, uint32_t val)
         if (!SPICE_RING_IS_EMPTY(&header->release_ring)) {
             break;
         }
-        sched_yield();
-        if (!SPICE_RING_IS_EMPTY(&header->release_ring)) {
-            break;
-        }
-        spice_qxl_oom(&qxl->display_sin);
+        qxl_notify_oom(qxl);
         break;
     case QXL_IO_SET_MODE:
         dprint(1, "QXL_SET_MODE %d\n", val);
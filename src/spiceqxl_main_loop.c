@@ -23,6 +23,9 @@
 #include "config.h"
 #endif
 
+#include <errno.h>
+#include <string.h>
+#include <sys/epoll.h>
 #include <sys/time.h>
 
 #include <spice.h>
@@ -193,19 +196,134 @@ static void timer_remove(SpiceTimer *timer)
     free(timer);
 }
 
+/*
+ * Servers with SetNotifyFd poll each watch fd themselves, with the right
+ * read/write interest, and call back per fd.
+ *
+ * Older servers only offer block/wakeup handlers around select(). There
+ * the watches live in an epoll set and only the epoll fd is handed to the
+ * X server, so the cost of a wakeup depends on the number of ready fds,
+ * not on the number of watches.
+ */
+#if XORG_VERSION_CURRENT >= XORG_VERSION_NUMERIC(1, 19, 0, 0, 0)
+#define XSPICE_NOTIFY_FD 1
+#endif
+
+#define MAX_WATCH_EVENTS 64
+
 struct SpiceWatch {
-    RingItem link;
+    RingItem link; /* on removed_watches once removed */
     int fd;
     int event_mask;
     SpiceWatchFunc func;
     void *opaque;
     int remove;
+    int registered;
 };
 
-Ring watches;
+#ifndef XSPICE_NOTIFY_FD
+static int watch_epoll_fd = -1;
+#endif
+
+/* removed watches are only freed outside of dispatch, since an event
+ * for them may still be pending in the current batch */
+static Ring removed_watches;
 
 int watch_count = 0;
 
+#ifdef XSPICE_NOTIFY_FD
+static void watch_notify(int fd, int ready, void *data)
+{
+    SpiceWatch *watch = data;
+
+#ifdef X_NOTIFY_ERROR
+    if (ready & X_NOTIFY_ERROR) {
+        /* let the callback find out through read/write */
+        ready |= X_NOTIFY_READ | X_NOTIFY_WRITE;
+    }
+#endif
+    if (!watch->remove && (watch->event_mask & SPICE_WATCH_EVENT_READ)
+         && (ready & X_NOTIFY_READ)) {
+        watch->func(watch->fd, SPICE_WATCH_EVENT_READ, watch->opaque);
+    }
+    if (!watch->remove && (watch->event_mask & SPICE_WATCH_EVENT_WRITE)
+         && (ready & X_NOTIFY_WRITE)) {
+        watch->func(watch->fd, SPICE_WATCH_EVENT_WRITE, watch->opaque);
+    }
+}
+
+static int watch_set_events(SpiceWatch *watch)
+{
+    int mask = 0;
+
+    if (watch->event_mask & SPICE_WATCH_EVENT_READ) {
+        mask |= X_NOTIFY_READ;
+    }
+    if (watch->event_mask & SPICE_WATCH_EVENT_WRITE) {
+        mask |= X_NOTIFY_WRITE;
+    }
+    if (!SetNotifyFd(watch->fd, watch_notify, mask, watch)) {
+        fprintf(stderr, "%s: SetNotifyFd fd %d failed\n", __FUNCTION__,
+                watch->fd);
+        return -1;
+    }
+    watch->registered = TRUE;
+    return 0;
+}
+
+static void watch_unregister(SpiceWatch *watch)
+{
+    RemoveNotifyFd(watch->fd);
+}
+
+#else /* !XSPICE_NOTIFY_FD */
+
+static uint32_t watch_epoll_events(int event_mask)
+{
+    uint32_t events = 0;
+
+    if (event_mask & SPICE_WATCH_EVENT_READ) {
+        events |= EPOLLIN;
+    }
+    if (event_mask & SPICE_WATCH_EVENT_WRITE) {
+        events |= EPOLLOUT;
+    }
+    return events;
+}
+
+static int watch_set_events(SpiceWatch *watch)
+{
+    struct epoll_event ev;
+    int op;
+
+    ev.events = watch_epoll_events(watch->event_mask);
+    ev.data.ptr = watch;
+    if (!ev.events) {
+        /* drop it from the set, otherwise a hangup would still be
+         * reported for a watch no one is listening to */
+        if (!watch->registered) {
+            return 0;
+        }
+        op = EPOLL_CTL_DEL;
+    } else {
+        op = watch->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    }
+    if (epoll_ctl(watch_epoll_fd, op, watch->fd, &ev) == -1) {
+        fprintf(stderr, "%s: epoll_ctl fd %d: %s\n", __FUNCTION__,
+                watch->fd, strerror(errno));
+        return -1;
+    }
+    watch->registered = (op != EPOLL_CTL_DEL);
+    return 0;
+}
+
+static void watch_unregister(SpiceWatch *watch)
+{
+    epoll_ctl(watch_epoll_fd, EPOLL_CTL_DEL, watch->fd, NULL);
+}
+
+#endif /* XSPICE_NOTIFY_FD */
+
 static SpiceWatch *watch_add(int fd, int event_mask, SpiceWatchFunc func, void *opaque)
 {
     SpiceWatch *watch = malloc(sizeof(SpiceWatch));
@@ -217,8 +335,12 @@ static SpiceWatch *watch_add(int fd, int event_mask, SpiceWatchFunc func, void *
     watch->func = func;
     watch->opaque = opaque;
     watch->remove = FALSE;
+    watch->registered = FALSE;
     ring_item_init(&watch->link);
-    ring_add(&watches, &watch->link);
+    if (watch_set_events(watch) == -1) {
+        free(watch);
+        return NULL;
+    }
     watch_count++;
     return watch;
 }
@@ -227,39 +349,76 @@ static void watch_update_mask(SpiceWatch *watch, int event_mask)
 {
     DPRINTF(0, "fd %d to %d", watch->fd, event_mask);
     watch->event_mask = event_mask;
+    watch_set_events(watch);
 }
 
 static void watch_remove(SpiceWatch *watch)
 {
     DPRINTF(0, "remove %p (fd %d)", watch, watch->fd);
+    if (watch->registered) {
+        watch_unregister(watch);
+        watch->registered = FALSE;
+    }
     watch->remove = TRUE;
+    ring_add(&removed_watches, &watch->link);
     watch_count--;
 }
 
+static void free_removed_watches(void)
+{
+    RingItem *link;
+
+    while ((link = ring_get_head(&removed_watches))) {
+        ring_remove(link);
+        free((SpiceWatch*)link);
+    }
+}
+
 static void channel_event(int event, SpiceChannelEventInfo *info)
 {
     NOT_IMPLEMENTED
 }
 
-static int set_watch_fds(fd_set *rfds, fd_set *wfds)
+#ifdef XSPICE_NOTIFY_FD
+
+static void xspice_block_handler(void *data, void *timeout)
 {
-    SpiceWatch *watch;
-    RingItem *link;
-    RingItem *next;
-    int max_fd = -1;
+    free_removed_watches();
+}
+
+static void xspice_wakeup_handler(void *data, int result)
+{
+}
 
-    RING_FOREACH_SAFE(link, next, &watches) {
-        watch = (SpiceWatch*)link;
-        if (watch->event_mask & SPICE_WATCH_EVENT_READ) {
-            FD_SET(watch->fd, rfds);
-            max_fd = watch->fd > max_fd ? watch->fd : max_fd;
+#else /* !XSPICE_NOTIFY_FD */
+
+static void dispatch_watches(void)
+{
+    struct epoll_event events[MAX_WATCH_EVENTS];
+    SpiceWatch *watch;
+    uint32_t ready;
+    int i, n;
+
+    n = epoll_wait(watch_epoll_fd, events, MAX_WATCH_EVENTS, 0);
+    for (i = 0; i < n; i++) {
+        watch = events[i].data.ptr;
+        ready = events[i].events;
+        if (ready & (EPOLLERR | EPOLLHUP)) {
+            /* let the callback find out through read/write */
+            ready |= EPOLLIN | EPOLLOUT;
         }
-        if (watch->event_mask & SPICE_WATCH_EVENT_WRITE) {
-            FD_SET(watch->fd, wfds);
-            max_fd = watch->fd > max_fd ? watch->fd : max_fd;
+        if (!watch->remove && (watch->event_mask & SPICE_WATCH_EVENT_READ)
+             && (ready & EPOLLIN)) {
+            watch->func(watch->fd, SPICE_WATCH_EVENT_READ, watch->opaque);
+        }
+        if (!watch->remove && (watch->event_mask & SPICE_WATCH_EVENT_WRITE)
+             && (ready & EPOLLOUT)) {
+            watch->func(watch->fd, SPICE_WATCH_EVENT_WRITE, watch->opaque);
         }
     }
-    return max_fd;
+    /* anything left over keeps the epoll fd readable, and is picked
+     * up on the next wakeup */
+    free_removed_watches();
 }
 
 /*
@@ -269,78 +428,29 @@ static int set_watch_fds(fd_set *rfds, fd_set *wfds)
  */
 static void xspice_block_handler(pointer data, OSTimePtr timeout, pointer readmask)
 {
-    /* set all our fd's */
-    set_watch_fds((fd_set*)readmask, (fd_set*)readmask);
-}
-
-/*
- * xserver only calles wakeup_handler with the read fd_set, so we
- * must either patch it or do a polling select ourselves, this is the
- * later approach. Since we are already doing a polling select, we
- * already select on all (we could avoid selecting on the read since
- * that *is* actually taken care of by the wakeup handler).
- */
-static void select_and_check_watches(void)
-{
-    fd_set rfds, wfds;
-    int max_fd = -1;
-    SpiceWatch *watch;
-    RingItem *link;
-    RingItem *next;
-    struct timeval timeout;
-    int retval;
-
-    FD_ZERO(&rfds);
-    FD_ZERO(&wfds);
-    max_fd = set_watch_fds(&rfds, &wfds);
-    watch = (SpiceWatch*)watches.next;
-    timeout.tv_sec = timeout.tv_usec = 0;
-    retval = select(max_fd + 1, &rfds, &wfds, NULL, &timeout);
-    if (retval) {
-        RING_FOREACH_SAFE(link, next, &watches) {
-            watch = (SpiceWatch*)link;
-            if (!watch->remove && (watch->event_mask & SPICE_WATCH_EVENT_READ)
-                 && FD_ISSET(watch->fd, &rfds)) {
-                watch->func(watch->fd, SPICE_WATCH_EVENT_READ, watch->opaque);
-            }
-            if (!watch->remove && (watch->event_mask & SPICE_WATCH_EVENT_WRITE)
-                 && FD_ISSET(watch->fd, &wfds)) {
-                watch->func(watch->fd, SPICE_WATCH_EVENT_WRITE, watch->opaque);
-            }
-            if (watch->remove) {
-                ring_remove(&watch->link);
-                free(watch);
-            }
-        }
-    }
-}
-
-static int no_write_watches(Ring *w)
-{
-    SpiceWatch *watch;
-    RingItem *link;
-    RingItem *next;
-
-    RING_FOREACH_SAFE(link, next, w) {
-        watch = (SpiceWatch*)link;
-        if (!watch->remove && (watch->event_mask & SPICE_WATCH_EVENT_WRITE))
-            return 0;
-    }
-
-    return 1;
+    free_removed_watches();
+    FD_SET(watch_epoll_fd, (fd_set*)readmask);
 }
 
 static void xspice_wakeup_handler(pointer data, int nfds, pointer readmask)
 {
-    if (!nfds && no_write_watches(&watches)) {
-        return;
+    if (nfds > 0 && FD_ISSET(watch_epoll_fd, (fd_set*)readmask)) {
+        dispatch_watches();
     }
-    select_and_check_watches();
 }
 
+#endif /* XSPICE_NOTIFY_FD */
+
 SpiceCoreInterface *basic_event_loop_init(void)
 {
-    ring_init(&watches);
+    ring_init(&removed_watches);
+#ifndef XSPICE_NOTIFY_FD
+    watch_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (watch_epoll_fd == -1) {
+        FatalError("%s: epoll_create1 failed: %s\n", __FUNCTION__,
+                   strerror(errno));
+    }
+#endif
     bzero(&core, sizeof(core));
     core.base.major_version = SPICE_INTERFACE_CORE_MAJOR;
     core.base.minor_version = SPICE_INTERFACE_CORE_MINOR; // anything less then 3 and channel_event isn't called
@@ -0,0 +1,52 @@
+#!/usr/bin/python
+
+import re
+import tempfile
+from time import sleep
+from xspice_render_test_helper import (composite_without_drawable, put_image_repeatedly,
+                                       draw_repeatedly)
+from xspice_util import launch_xspice, launch_client
+
+def test_composite_without_drawable(port):
+    xspice = launch_xspice(port)
+    sleep(2)
+    client = launch_client(port)
+    sleep(1)
+    composite_without_drawable(':15.0')
+    sleep(1)
+    assert xspice.poll() is None, 'Xspice died compositing a picture without a drawable'
+    client.kill()
+    xspice.kill()
+
+def promoted_after(port, draw):
+    # -terminate makes the server exit, printing its pixmap statistics,
+    # once the last client is gone
+    log = tempfile.TemporaryFile()
+    xspice = launch_xspice(port, xorg_args=['-terminate'], stderr=log)
+    sleep(2)
+    draw(':15.0')
+    for i in range(10):
+        if xspice.poll() is not None:
+            break
+        sleep(1)
+    log.seek(0)
+    stats = re.search(r'promoted: (\d+)', log.read())
+    assert stats, 'no pixmap statistics in the server output'
+    return int(stats.group(1))
+
+def test_put_image_does_not_promote(port):
+    promoted = promoted_after(port, lambda display: put_image_repeatedly(display, 8))
+    assert promoted == 0, 'PutImage promoted a host pixmap'
+
+def test_drawing_promotes(port):
+    promoted = promoted_after(port, lambda display: draw_repeatedly(display, 8))
+    assert promoted >= 2, 'fills and composites did not promote their host pixmaps'
+
+def main():
+    port = 8000
+    test_composite_without_drawable(port)
+    test_put_image_does_not_promote(port)
+    test_drawing_promotes(port)
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,166 @@
+#!/usr/bin/python
+# coding: utf-8
+import sys
+from ctypes import (CDLL, POINTER, Structure, byref, c_char_p, c_int,
+                    c_uint, c_ulong, c_ushort, c_void_p, create_string_buffer)
+
+ZPixmap = 2
+PictOpSrc = 1
+PictOpOver = 3
+PictStandardARGB32 = 0
+
+class XRenderColor(Structure):
+    _fields_ = [('red', c_ushort), ('green', c_ushort),
+                ('blue', c_ushort), ('alpha', c_ushort)]
+
+class XPointFixed(Structure):
+    _fields_ = [('x', c_int), ('y', c_int)]
+
+class XLinearGradient(Structure):
+    _fields_ = [('p1', XPointFixed), ('p2', XPointFixed)]
+
+def xfixed(v):
+    return int(v * 65536)
+
+class Display(object):
+    def __init__(self, name):
+        self.x11 = CDLL('libX11.so.6')
+        self.xrender = CDLL('libXrender.so.1')
+        self.x11.XOpenDisplay.restype = c_void_p
+        self.x11.XOpenDisplay.argtypes = [c_char_p]
+        self.x11.XDefaultRootWindow.restype = c_ulong
+        self.x11.XDefaultRootWindow.argtypes = [c_void_p]
+        self.x11.XCreateSimpleWindow.restype = c_ulong
+        self.x11.XCreateSimpleWindow.argtypes = [c_void_p, c_ulong, c_int, c_int,
+                                                 c_uint, c_uint, c_uint, c_ulong, c_ulong]
+        self.x11.XMapWindow.argtypes = [c_void_p, c_ulong]
+        self.x11.XCreatePixmap.restype = c_ulong
+        self.x11.XCreatePixmap.argtypes = [c_void_p, c_ulong, c_uint, c_uint, c_uint]
+        self.x11.XSync.argtypes = [c_void_p, c_int]
+        self.x11.XCloseDisplay.argtypes = [c_void_p]
+        self.x11.XDefaultGC.restype = c_void_p
+        self.x11.XDefaultGC.argtypes = [c_void_p, c_int]
+        self.x11.XCreateImage.restype = c_void_p
+        self.x11.XCreateImage.argtypes = [c_void_p, c_void_p, c_uint, c_int, c_int,
+                                          c_void_p, c_uint, c_uint, c_int, c_int]
+        self.x11.XPutImage.argtypes = [c_void_p, c_ulong, c_void_p, c_void_p,
+                                       c_int, c_int, c_int, c_int, c_uint, c_uint]
+        self.x11.XFillRectangle.argtypes = [c_void_p, c_ulong, c_void_p,
+                                            c_int, c_int, c_uint, c_uint]
+        self.xrender.XRenderFindStandardFormat.restype = c_void_p
+        self.xrender.XRenderFindStandardFormat.argtypes = [c_void_p, c_int]
+        self.xrender.XRenderFindVisualFormat.restype = c_void_p
+        self.xrender.XRenderFindVisualFormat.argtypes = [c_void_p, c_void_p]
+        self.x11.XDefaultVisual.restype = c_void_p
+        self.x11.XDefaultVisual.argtypes = [c_void_p, c_int]
+        self.xrender.XRenderCreatePicture.restype = c_ulong
+        self.xrender.XRenderCreatePicture.argtypes = [c_void_p, c_ulong, c_void_p,
+                                                      c_ulong, c_void_p]
+        self.xrender.XRenderCreateSolidFill.restype = c_ulong
+        self.xrender.XRenderCreateSolidFill.argtypes = [c_void_p, POINTER(XRenderColor)]
+        self.xrender.XRenderCreateLinearGradient.restype = c_ulong
+        self.xrender.XRenderCreateLinearGradient.argtypes = [
+            c_void_p, POINTER(XLinearGradient), POINTER(c_int),
+            POINTER(XRenderColor), c_int]
+        self.xrender.XRenderComposite.argtypes = [c_void_p, c_int, c_ulong, c_ulong,
+                                                  c_ulong, c_int, c_int, c_int, c_int,
+                                                  c_int, c_int, c_uint, c_uint]
+        self.dpy = self.x11.XOpenDisplay(name)
+        if not self.dpy:
+            raise SystemExit('cannot open display %s' % name)
+        self.root = self.x11.XDefaultRootWindow(self.dpy)
+
+    def sync(self):
+        self.x11.XSync(self.dpy, 0)
+
+    def close(self):
+        self.x11.XCloseDisplay(self.dpy)
+
+    def pixmap(self, width, height, depth):
+        return self.x11.XCreatePixmap(self.dpy, self.root, width, height, depth)
+
+    def put_image(self, drawable, width, height, fill):
+        # 24 and 32 bit images both use four bytes a pixel
+        data = create_string_buffer(fill * (width * height * 4))
+        visual = self.x11.XDefaultVisual(self.dpy, 0)
+        image = self.x11.XCreateImage(self.dpy, visual, 24, ZPixmap, 0, data,
+                                      width, height, 32, 0)
+        gc = self.x11.XDefaultGC(self.dpy, 0)
+        self.x11.XPutImage(self.dpy, drawable, gc, image, 0, 0, 0, 0, width, height)
+        self.sync()
+
+    def fill(self, drawable, width, height):
+        gc = self.x11.XDefaultGC(self.dpy, 0)
+        self.x11.XFillRectangle(self.dpy, drawable, gc, 0, 0, width, height)
+
+    def window_picture(self, width, height):
+        window = self.x11.XCreateSimpleWindow(self.dpy, self.root, 0, 0,
+                                              width, height, 0, 0, 0)
+        self.x11.XMapWindow(self.dpy, window)
+        visual = self.x11.XDefaultVisual(self.dpy, 0)
+        fmt = self.xrender.XRenderFindVisualFormat(self.dpy, visual)
+        return self.xrender.XRenderCreatePicture(self.dpy, window, fmt, 0, None)
+
+    def pixmap_picture(self, width, height):
+        pixmap = self.x11.XCreatePixmap(self.dpy, self.root, width, height, 32)
+        fmt = self.xrender.XRenderFindStandardFormat(self.dpy, PictStandardARGB32)
+        return self.xrender.XRenderCreatePicture(self.dpy, pixmap, fmt, 0, None)
+
+    def solid_fill(self, red, green, blue, alpha):
+        color = XRenderColor(red, green, blue, alpha)
+        return self.xrender.XRenderCreateSolidFill(self.dpy, byref(color))
+
+    def linear_gradient(self, width):
+        gradient = XLinearGradient(XPointFixed(0, 0), XPointFixed(xfixed(width), 0))
+        stops = (c_int * 2)(0, xfixed(1))
+        colors = (XRenderColor * 2)(XRenderColor(0xffff, 0, 0, 0xffff),
+                                    XRenderColor(0, 0, 0xffff, 0xffff))
+        return self.xrender.XRenderCreateLinearGradient(self.dpy, byref(gradient),
+                                                        stops, colors, 2)
+
+    def composite(self, op, src, dst, width, height):
+        self.xrender.XRenderComposite(self.dpy, op, src, 0, dst,
+                                      0, 0, 0, 0, 0, 0, width, height)
+
+def composite_without_drawable(display_name):
+    """Composite solid fill and gradient pictures, which have no drawable,
+    onto a window and a pixmap. Returns once the server has processed them."""
+    display = Display(display_name)
+    width, height = 64, 64
+    sources = [display.solid_fill(0xffff, 0, 0, 0xffff),
+               display.solid_fill(0, 0xffff, 0, 0x8000),
+               display.linear_gradient(width)]
+    targets = [display.window_picture(width, height),
+               display.pixmap_picture(width, height)]
+    for dst in targets:
+        for src in sources:
+            for op in (PictOpSrc, PictOpOver):
+                display.composite(op, src, dst, width, height)
+    display.sync()
+
+def put_image_repeatedly(display_name, count):
+    """Upload images into a pixmap that is never used otherwise, then
+    disconnect. The pixmap lives in host memory and should stay there."""
+    display = Display(display_name)
+    width, height = 64, 64
+    pixmap = display.pixmap(width, height, 24)
+    for i in range(count):
+        display.put_image(pixmap, width, height, chr(i))
+    display.close()
+
+def draw_repeatedly(display_name, count):
+    """Fill one pixmap and composite a solid colour into another, count
+    times each, then disconnect. Both start in host memory and should be
+    moved to the device by the repeated drawing."""
+    display = Display(display_name)
+    width, height = 64, 64
+    pixmap = display.pixmap(width, height, 24)
+    picture = display.pixmap_picture(width, height)
+    solid = display.solid_fill(0, 0, 0xffff, 0xffff)
+    for i in range(count):
+        display.fill(pixmap, width, height)
+        display.composite(PictOpOver, solid, picture, width, height)
+    display.close()
+
+if __name__ == '__main__':
+    composite_without_drawable(sys.argv[-1] if len(sys.argv) > 1 else ':15.0')
@@ -52,12 +52,12 @@ client_executable = which('remote-viewer')
 if not client_executable:
     raise SystemExit('missing remote-viewer in path')
 
-def launch_xspice(port):
+def launch_xspice(port, xorg_args=[], stderr=None):
     basedir = '/tmp/xspice_test_audio'
     if not os.path.exists(basedir):
         os.mkdir(basedir)
     assert(os.path.exists(basedir))
-    xspice = Process.new(['../scripts/Xspice', '--port', '8000', '--auto', '--audio-fifo-dir', basedir, '--disable-ticketing', ':15.0'])
+    xspice = Process.new(['../scripts/Xspice', '--port', '8000', '--auto', '--audio-fifo-dir', basedir, '--disable-ticketing', ':15.0'] + xorg_args, stderr=stderr)
     xspice.audio_fifo_dir = basedir
     return xspice
 